@@ -0,0 +1,61 @@
+/**
+ * Lines per second executed by batch mode for a builtin-only script, run
+ * in-process through run_batch and, for reference, by bash on the same file.
+ *
+ * Build: gcc -O2 -pthread -o batch_bench bench/batch_bench.c
+ * Usage: ./batch_bench [lines]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+int main(int argc, char *argv[]){
+	int n = argc > 1 ? atoi(argv[1]) : 1000000;
+	static const char *lines[] = {
+		"set -o pipefail",
+		"cd .",
+		"# a comment line",
+		"set +o pipefail",
+		"hash -r",
+		"set -o",
+	};
+	char path[] = "/tmp/batch_bench.XXXXXX";
+	int fd = mkstemp(path);
+	FILE *f = fdopen(fd, "w");
+	for(int i = 0; i < n; i++)
+		fprintf(f, "%s\n", lines[i % 6]);
+	fclose(f);
+
+	//set -o prints, keep that out of the way
+	fflush(stdout);
+	int saved = dup(STDOUT_FILENO);
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+
+	fd = open(path, O_RDONLY);
+	double start = now_s();
+	run_batch(fd);
+	fflush(stdout);
+	double shellax = now_s() - start;
+	close(fd);
+
+	double bash = 0;
+	if(access("/bin/bash", X_OK) == 0){
+		start = now_s();
+		pid_t pid = fork();
+		if(pid == 0){
+			execl("/bin/bash", "bash", path, (char *)NULL);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+		bash = now_s() - start;
+	}
+
+	dup2(saved, STDOUT_FILENO);
+	unlink(path);
+	printf("%d builtin lines\n", n);
+	printf("shellax batch %12.0f lines/s\n", n / shellax);
+	if(bash > 0)
+		printf("bash          %12.0f lines/s\n", n / bash);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/**
+ * Clock helpers shared by the benchmarks, included after shellax-skeleton.c
+ */
+#ifndef SHELLAX_BENCH_H
+#define SHELLAX_BENCH_H
+
+#include <time.h>
+
+static inline double now_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline double now_us(void){
+	return now_ns() / 1e3;
+}
+
+static inline double now_s(void){
+	return now_ns() / 1e9;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * Startup-to-first-exec latency of a script run plainly, with --cache and
+ * no cache file (cold) and with --cache and a valid cache file (warm). The
+ * script is a block of builtin lines followed by the first external command,
+ * which is this program reporting the time it was exec'd.
+ *
+ * Build: gcc -O2 -pthread -o cache_bench bench/cache_bench.c
+ * Usage: ./cache_bench path/to/shellax [builtin-lines] [runs]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+//Start the shell and return how long it took until the stamp line ran
+static double first_exec(const char *shell, const char *flag, const char *script){
+	int fds[2];
+	char buf[64];
+	pipe(fds);
+	double start = now_us();
+	pid_t pid = fork();
+	if(pid == 0){
+		dup2(fds[1], STDOUT_FILENO);
+		if(flag != NULL)
+			execl(shell, shell, flag, script, (char *)NULL);
+		else
+			execl(shell, shell, script, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	ssize_t n = read(fds[0], buf, sizeof(buf) - 1);
+	close(fds[0]);
+	waitpid(pid, NULL, 0);
+	buf[n > 0 ? n : 0] = '\0';
+	return atof(buf) - start;
+}
+
+int main(int argc, char *argv[]){
+	if(argc > 1 && strcmp(argv[1], "--stamp") == 0){
+		printf("%.3f\n", now_us());
+		return 0;
+	}
+	if(argc < 2){
+		printf("usage: %s path/to/shellax [builtin-lines] [runs]\n", argv[0]);
+		return 1;
+	}
+	const char *shell = argv[1];
+	int lines = argc > 2 ? atoi(argv[2]) : 5000;
+	int runs = argc > 3 ? atoi(argv[3]) : 20;
+	char self[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	self[len > 0 ? len : 0] = '\0';
+
+	char dir[] = "/tmp/cache_bench.XXXXXX", script[PATH_MAX], cache[PATH_MAX];
+	mkdtemp(dir);
+	snprintf(script, sizeof(script), "%s/job.sh", dir);
+	snprintf(cache, sizeof(cache), "%s/.job.sh.shxc", dir);
+	FILE *f = fopen(script, "w");
+	fprintf(f, "#!%s\n", shell);
+	for(int i = 0; i < lines; i++)
+		fprintf(f, i % 2 ? "cd \"%s\"   # stay where we are\n" : "set -o pipefail\n", dir);
+	fprintf(f, "%s --stamp\n", self);
+	fclose(f);
+
+	double plain = 0, cold = 0, warm = 0;
+	for(int i = 0; i < runs; i++){
+		plain += first_exec(shell, NULL, script);
+		unlink(cache);
+		cold += first_exec(shell, "--cache", script);
+		warm += first_exec(shell, "--cache", script);
+	}
+	unlink(cache);
+	unlink(script);
+	rmdir(dir);
+	printf("%d builtin lines before the first exec, mean of %d runs\n", lines, runs);
+	printf("plain          %10.1f us\n", plain / runs);
+	printf("--cache cold   %10.1f us\n", cold / runs);
+	printf("--cache warm   %10.1f us\n", warm / runs);
+	return 0;
+}
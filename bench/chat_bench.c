@@ -0,0 +1,254 @@
+/**
+ * Chatroom load generator: for each room size, N participants run the real
+ * chatroom() in child processes, wired to pipes, and this program types
+ * timestamped lines into them at a fixed total rate, round robin. Every
+ * line each participant prints is checked and timed, giving end-to-end
+ * delivery latency percentiles, throughput, and counts of lost, merged and
+ * truncated messages against the N-1 deliveries each sent line should make.
+ *
+ * Build: gcc -O2 -pthread -o chat_bench bench/chat_bench.c
+ * Usage: ./chat_bench [--shm] [users,users,...] [messages-per-second] [seconds] [payload-bytes]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+#define BENCH_MAX_USERS 1000
+
+struct participant {
+	pid_t pid;
+	int in_fd, out_fd; // its stdin and stdout
+	char *buf; // partial output line
+	size_t len, cap;
+	bool joined;
+	unsigned char *seen; // [sender * sent_per_user + seq], drops duplicates
+};
+
+struct result {
+	double *latency; // microseconds
+	size_t count, cap;
+	unsigned long merged, truncated, duplicate, missed_notices;
+};
+
+static int cmp_double(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+//Fork a participant running chatroom() on the real code path
+static void start_participant(struct participant *p, const char *room, int index, bool shm){
+	int in[2], out[2];
+	pipe2(in, O_CLOEXEC);
+	pipe2(out, O_CLOEXEC);
+	fflush(stdout);
+	p->pid = fork();
+	if(p->pid == 0){
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close_range(3, ~0U, 0);
+		char line[256];
+		snprintf(line, sizeof(line), "chatroom %s%s u%d", shm ? "--shm " : "", room, index);
+		struct command_t *command = alloc_command();
+		parse_command(line, command);
+		_exit(chatroom(command));
+	}
+	close(in[0]);
+	close(out[1]);
+	p->in_fd = in[1];
+	p->out_fd = out[0];
+	fcntl(p->out_fd, F_SETFL, O_NONBLOCK);
+}
+
+/**
+ * Check one printed line: "[room] u<sender>: <sender> <seq> <sent-ns> xxx...#"
+ * A line holding more than one message counts as merged, one whose payload
+ * is cut short as truncated.
+ */
+static void check_line(struct participant *p, const char *line, size_t len, const char *room,
+		int users, int sent_per_user, size_t payload, long long now, struct result *res){
+	char head[128];
+	int head_len = snprintf(head, sizeof(head), "[%s] ", room);
+	if(len == 0 || strncmp(line, "Welcome", 7) == 0){
+		p->joined = true;
+		return;
+	}
+	if(memmem(line, len, "missed", 6) != NULL){
+		res->missed_notices++;
+		return;
+	}
+	if(memmem(line + 1, len - 1, head, head_len) != NULL){
+		res->merged++;
+		return;
+	}
+	const char *colon = memchr(line, ':', len);
+	int sender, seq;
+	long long sent;
+	if(strncmp(line, head, head_len) != 0 || colon == NULL
+			|| sscanf(colon + 1, " %d %d %lld", &sender, &seq, &sent) != 3
+			|| sender < 0 || sender >= users || seq < 0 || seq >= sent_per_user){
+		res->truncated++;
+		return;
+	}
+	size_t expected = colon + 2 - line + payload;
+	if(len != expected || line[len - 1] != '#'){
+		res->truncated++;
+		return;
+	}
+	unsigned char *seen = &p->seen[(size_t)sender * sent_per_user + seq];
+	if(*seen){
+		res->duplicate++;
+		return;
+	}
+	*seen = 1;
+	if(res->count == res->cap){
+		res->cap = res->cap ? res->cap * 2 : 65536;
+		res->latency = realloc(res->latency, res->cap * sizeof(double));
+	}
+	res->latency[res->count++] = (now - sent) / 1e3;
+}
+
+static void drain(int epoll_fd, struct participant *p, const char *room, int users, int sent_per_user,
+		size_t payload, struct result *res){
+	while(1){
+		if(p->cap - p->len < 65536){
+			p->cap = p->cap ? p->cap * 2 : 1 << 17;
+			p->buf = realloc(p->buf, p->cap);
+		}
+		ssize_t r = read(p->out_fd, p->buf + p->len, p->cap - p->len);
+		if(r == 0) // it exited, e.g. failed to join
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p->out_fd, NULL);
+		if(r <= 0)
+			return;
+		long long now = now_ns();
+		p->len += r;
+		char *start = p->buf, *nl;
+		while((nl = memchr(start, '\n', p->buf + p->len - start)) != NULL){
+			check_line(p, start, nl - start, room, users, sent_per_user, payload, now, res);
+			start = nl + 1;
+		}
+		p->len -= start - p->buf;
+		memmove(p->buf, start, p->len);
+	}
+}
+
+static void run_room(int users, bool shm, double rate, double seconds, size_t payload){
+	char room[64];
+	snprintf(room, sizeof(room), "bench%d", (int)getpid());
+	int sent_per_user = (int)(rate * seconds / users) + 1;
+	struct participant *parts = calloc(users, sizeof(struct participant));
+	struct result res = { 0 };
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	for(int i = 0; i < users; i++){
+		start_participant(&parts[i], room, i, shm);
+		parts[i].seen = calloc((size_t)users * sent_per_user, 1);
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &parts[i] };
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, parts[i].out_fd, &ev);
+	}
+
+	//everyone has joined once they all said Welcome; then let membership settle,
+	//which for members past the inotify limit takes one rescan
+	struct epoll_event events[64];
+	for(int joined = 0; joined < users; ){
+		int n = epoll_wait(epoll_fd, events, 64, 1000);
+		for(int i = 0; i < n; i++)
+			drain(epoll_fd, events[i].data.ptr, room, users, sent_per_user, payload, &res);
+		joined = 0;
+		for(int i = 0; i < users; i++)
+			joined += parts[i].joined;
+		if(n == 0)
+			break;
+	}
+	usleep(1500000);
+
+	char *line = malloc(payload + 128);
+	long long start = now_ns(), interval = (long long)(1e9 / rate);
+	long sent = 0, total = (long)sent_per_user * users;
+	while(sent < total){
+		long long due = start + sent * interval, now = now_ns();
+		if(now >= due){
+			int sender = sent % users, seq = sent / users;
+			int n = snprintf(line, payload + 128, "%d %d %lld ", sender, seq, (long long)now_ns());
+			//pad the payload to its size, ending in a marker a cut would lose
+			while((size_t)n < payload - 1)
+				line[n++] = 'x';
+			line[n++] = '#';
+			line[n++] = '\n';
+			write(parts[sender].in_fd, line, n);
+			sent++;
+			continue;
+		}
+		int timeout = (int)((due - now) / 1000000);
+		int n = epoll_wait(epoll_fd, events, 64, timeout);
+		for(int i = 0; i < n; i++)
+			drain(epoll_fd, events[i].data.ptr, room, users, sent_per_user, payload, &res);
+	}
+	double send_seconds = (now_ns() - start) / 1e9;
+	//collect until every delivery arrived or nothing came for a second
+	size_t expected = (size_t)total * (users - 1);
+	while(res.count < expected){
+		int n = epoll_wait(epoll_fd, events, 64, 1000);
+		if(n <= 0)
+			break;
+		for(int i = 0; i < n; i++)
+			drain(epoll_fd, events[i].data.ptr, room, users, sent_per_user, payload, &res);
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	for(int i = 0; i < users; i++){
+		close(parts[i].in_fd);
+		waitpid(parts[i].pid, NULL, 0);
+		close(parts[i].out_fd);
+		free(parts[i].buf);
+		free(parts[i].seen);
+	}
+	free(parts);
+	free(line);
+	close(epoll_fd);
+	char path[PATH_MAX];
+	if(shm){
+		snprintf(path, sizeof(path), "/shellax-chat-%s", room);
+		shm_unlink(path);
+	} else {
+		snprintf(path, sizeof(path), "/tmp/chatroom-%s", room);
+		rmdir(path);
+	}
+
+	qsort(res.latency, res.count, sizeof(double), cmp_double);
+	double p50 = 0, p99 = 0, p999 = 0;
+	if(res.count > 0){
+		p50 = res.latency[(size_t)(res.count * 0.50)];
+		p99 = res.latency[(size_t)(res.count * 0.99)];
+		p999 = res.latency[(size_t)(res.count * 0.999)];
+	}
+	printf("%6d %9.0f %9.0f %9.1f %9.1f %9.1f %9zu %8zu %7lu %9lu %7lu\n", users, total / send_seconds,
+			res.count / elapsed, p50, p99, p999, expected, expected - res.count,
+			res.merged, res.truncated, res.missed_notices);
+	fflush(stdout);
+	free(res.latency);
+}
+
+int main(int argc, char *argv[]){
+	bool shm = argc > 1 && strcmp(argv[1], "--shm") == 0;
+	argv += shm;
+	argc -= shm;
+	const char *sizes = argc > 1 ? argv[1] : "2,10,50,100,200";
+	double rate = argc > 2 ? atof(argv[2]) : 1000;
+	double seconds = argc > 3 ? atof(argv[3]) : 2;
+	size_t payload = argc > 4 ? strtoul(argv[4], NULL, 10) : 64;
+	if(payload < 40)
+		payload = 40; // room for the sender, sequence number and timestamp
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("%s transport, %.0f messages/s for %.1fs, %zu byte payloads\n", shm ? "shm ring" : "FIFO",
+			rate, seconds, payload);
+	printf("%6s %9s %9s %9s %9s %9s %9s %8s %7s %9s %7s\n", "users", "sent/s", "deliv/s",
+			"p50 us", "p99 us", "p999 us", "expected", "lost", "merged", "truncated", "missed");
+	for(const char *p = sizes; *p; ){
+		int users = atoi(p);
+		if(users >= 2 && users <= BENCH_MAX_USERS)
+			run_room(users, shm, rate, seconds, payload);
+		p += strcspn(p, ",");
+		p += *p == ',';
+	}
+	return 0;
+}
@@ -0,0 +1,52 @@
+/**
+ * Tab completion latency: building the PATH trie and completing command
+ * prefixes against it, and completing in a directory of 100k files cold,
+ * warm, and after the directory changed.
+ *
+ * Build: gcc -O2 -pthread -o complete_bench bench/complete_bench.c
+ * Usage: ./complete_bench [files]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+static double time_complete(const char *word, bool command, size_t *count){
+	const char **matches;
+	double start = now_us();
+	*count = complete_word(word, strlen(word), command, &matches);
+	return now_us() - start;
+}
+
+int main(int argc, char *argv[]){
+	int files = argc > 1 ? atoi(argv[1]) : 100000;
+	size_t count;
+
+	double t = time_complete("g", true, &count);
+	printf("PATH trie: %u nodes, first completion (builds it) %.0f us\n", command_trie.count, t);
+	static const char *prefixes[] = { "g", "gre", "x", "zzz", "" };
+	for(int i = 0; i < 5; i++){
+		t = time_complete(prefixes[i], true, &count);
+		printf("  command '%s': %zu matches in %.1f us\n", prefixes[i], count, t);
+	}
+
+	char dir[] = "/tmp/complete_bench.XXXXXX", path[PATH_MAX], word[PATH_MAX];
+	mkdtemp(dir);
+	for(int i = 0; i < files; i++){
+		snprintf(path, sizeof(path), "%s/file_%06d.txt", dir, i);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+	snprintf(word, sizeof(word), "%s/file_0421", dir);
+	printf("directory of %d files, completing file_0421:\n", files);
+	t = time_complete(word, false, &count);
+	printf("  cold (readdir + sort)  %10.0f us, %zu matches\n", t, count);
+	t = time_complete(word, false, &count);
+	printf("  warm (one stat)        %10.1f us, %zu matches\n", t, count);
+	snprintf(path, sizeof(path), "%s/file_042199_new", dir);
+	close(open(path, O_WRONLY | O_CREAT, 0644));
+	t = time_complete(word, false, &count);
+	printf("  after a new file       %10.0f us, %zu matches\n", t, count);
+
+	snprintf(word, sizeof(word), "rm -rf %s", dir);
+	system(word);
+	return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * History with 100k entries: time to map the file into the ring, to build
+ * the trigram index on the first Ctrl+R, and per-query search latency with
+ * the index against a plain scan of every entry.
+ *
+ * Build: gcc -O2 -pthread -o history_bench bench/history_bench.c
+ * Usage: ./history_bench [entries]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+static uint32_t scan_search(const char *query, size_t qlen){
+	for(uint32_t age = 1; age <= hist_count(); age++){
+		size_t len;
+		const char *s = hist_get(age, &len);
+		if(memmem(s, len, query, qlen) != NULL)
+			return age;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	int n = argc > 1 ? atoi(argv[1]) : 100000;
+	static const char *words[] = { "git", "make", "grep", "ls", "cd", "cat", "sort", "uniq",
+		"-la", "src", "build", "origin", "main", "*.c", "|", "-rn", "TODO", "docs", "tmp", "wc" };
+	char path[] = "/tmp/history_bench.XXXXXX";
+	int fd = mkstemp(path);
+	FILE *f = fdopen(fd, "w");
+	srand(1);
+	for(int i = 0; i < n; i++){
+		int k = 2 + rand() % 6;
+		for(int j = 0; j < k; j++)
+			fprintf(f, "%s%s", j ? " " : "", words[rand() % 20]);
+		fprintf(f, " %d\n", rand() % 100000);
+	}
+	fprintf(f, "ssh deploy@rare-host.example\n");
+	for(int i = 0; i < 1000; i++)
+		fprintf(f, "make -j8 test\n");
+	fclose(f);
+	setenv("HISTFILE", path, 1);
+
+	double start = now_us();
+	hist_sync();
+	printf("%u entries in the ring in %.0f us\n", hist_count(), now_us() - start);
+	start = now_us();
+	hist_search("xyz", 3, 1);
+	printf("first search, building the index: %.0f us\n", now_us() - start);
+
+	static const char *queries[] = { "make -j8", "rare-host", "origin main 4242", "no such thing" };
+	printf("%-18s %10s %10s\n", "query", "index us", "scan us");
+	for(int q = 0; q < 4; q++){
+		size_t qlen = strlen(queries[q]);
+		uint32_t a = 0, b = 0;
+		int reps = 100;
+		start = now_us();
+		for(int i = 0; i < reps; i++)
+			a = hist_search(queries[q], qlen, 1);
+		double indexed = (now_us() - start) / reps;
+		start = now_us();
+		for(int i = 0; i < reps; i++)
+			b = scan_search(queries[q], qlen);
+		double scanned = (now_us() - start) / reps;
+		printf("%-18s %10.1f %10.1f%s\n", queries[q], indexed, scanned, a == b ? "" : "  MISMATCH");
+	}
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,70 @@
+/**
+ * Cost of parse_command + free_command per input line: wall time and the
+ * number of malloc/realloc/calloc calls, for a short command, a 16-stage
+ * pipeline, a command with 200 arguments and one with quoting and escapes.
+ *
+ * Build: gcc -O2 -pthread -Wl,--wrap=malloc,--wrap=realloc,--wrap=calloc \
+ *            -o parse_bench bench/parse_bench.c
+ * Usage: ./parse_bench [lines-per-case]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+//volatile so the compiler can't assume malloc leaves it alone
+static volatile unsigned long allocs;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+
+void *__wrap_malloc(size_t size){
+	allocs++;
+	return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+	allocs++;
+	return __real_realloc(ptr, size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size){
+	allocs++;
+	return __real_calloc(nmemb, size);
+}
+
+int main(int argc, char *argv[]){
+	int n = argc > 1 ? atoi(argv[1]) : 20000;
+	static char pipeline[4096], args[8192] = "grep", buf[8192];
+	for(int i = 0; i < 16; i++)
+		strcat(pipeline, i ? " | cat -n file.txt" : "cat -n file.txt");
+	for(int i = 0; i < 200; i++)
+		strcat(args, " argument");
+	const char *cases[][2] = {
+		{ "short", "ls -la /tmp >out.txt" },
+		{ "pipeline16", pipeline },
+		{ "args200", args },
+		{ "quoted", "grep -e \"two words\" 'single $quoted' a\\ b \"esc\\\"aped\" <in.txt 2>err.txt" },
+	};
+
+	for(int c = 0; c < 4; c++){
+		//one untimed line so the arena's first chunk isn't counted
+		strcpy(buf, cases[c][1]);
+		struct command_t *command = alloc_command();
+		parse_command(buf, command);
+		free_command(command);
+
+		allocs = 0;
+		double start = now_ns();
+		for(int i = 0; i < n; i++){
+			strcpy(buf, cases[c][1]);
+			command = alloc_command();
+			parse_command(buf, command);
+			free_command(command);
+		}
+		double elapsed = now_ns() - start;
+		printf("%-12s %10.0f ns/line %8.1f MB/s %8.2f allocs/line\n", cases[c][0], elapsed / n,
+				strlen(cases[c][1]) * (double)n / elapsed * 1e3, (double)allocs / n);
+	}
+	return 0;
+}
@@ -0,0 +1,57 @@
+/**
+ * Per-launch latency of fork()+execv() against the posix_spawn path used by
+ * process_command, measured while the shell's resident set grows.
+ *
+ * Build: gcc -O2 -o spawn_bench bench/spawn_bench.c
+ * Usage: ./spawn_bench [launches-per-size]
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+static double fork_exec(const char *path, int n){
+	char *argv[] = { "true", NULL };
+	double start = now_us();
+	for(int i = 0; i < n; i++){
+		pid_t pid = fork();
+		if(pid == 0){
+			execv(path, argv);
+			_exit(127);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	return (now_us() - start) / n;
+}
+
+static double shell_spawn(int n){
+	char line[] = "true";
+	struct command_t *command = alloc_command();
+	parse_command(line, command);
+	double start = now_us();
+	for(int i = 0; i < n; i++)
+		process_command(command);
+	double us = (now_us() - start) / n;
+	free_command(command);
+	return us;
+}
+
+int main(int argc, char *argv[]){
+	int n = argc > 1 ? atoi(argv[1]) : 500;
+	const size_t sizes_mb[] = { 0, 64, 256, 1024 };
+	const char *path = path_lookup("true");
+	char *ballast = NULL;
+	size_t have = 0;
+
+	printf("%10s %16s %16s\n", "rss_mb", "fork_exec_us", "spawn_us");
+	for(size_t i = 0; i < sizeof(sizes_mb)/sizeof(sizes_mb[0]); i++){
+		size_t want = sizes_mb[i] << 20;
+		if(want > have){
+			ballast = realloc(ballast, want);
+			memset(ballast + have, 1, want - have); //touch it so it's resident
+			have = want;
+		}
+		printf("%10zu %16.1f %16.1f\n", sizes_mb[i], fork_exec(path, n), shell_spawn(n));
+	}
+	free(ballast);
+	return 0;
+}
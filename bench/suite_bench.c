@@ -0,0 +1,159 @@
+/**
+ * The benchmark suite behind `make bench`: one number per hot path, written
+ * as a JSON object so runs on different commits can be diffed.
+ *   parse_ns_per_line     parse_command + free_command on a typical line
+ *   launch_us             process_command running `true` (spawn + wait)
+ *   pipeline_mb_s         cat stage pipelines of 2, 4 and 8 stages
+ *   uniq_mb_s             myuniq -c over a sorted file
+ *   builtin_lookup_ns     builtin_lookup of a name
+ *   builtin_dispatch_ns   process_command of a lone builtin (`set -o pipefail`)
+ * Each number is the best of a few repetitions.
+ *
+ * Build: gcc -O2 -pthread -o suite_bench bench/suite_bench.c
+ * Usage: ./suite_bench [data-MB] > bench.json (the commit id is taken from
+ *        $BENCH_COMMIT, data files go to $TMPDIR)
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+#define REPEATS 3
+
+static double best(double a, double b){
+	return a < b ? a : b;
+}
+
+//Sorted log-style lines with short runs of duplicates
+static void generate(const char *path, size_t bytes){
+	FILE *f = fopen(path, "w");
+	size_t written = 0;
+	unsigned long id = 0;
+	srand(304);
+	while(written < bytes){
+		int run = 1 + rand() % 8;
+		char line[128];
+		int len = snprintf(line, sizeof(line), "2022-11-17T12:00:00 GET /comp304/shellax/%010lu HTTP/1.1 200\n", id++);
+		for(int i = 0; i < run; i++)
+			fwrite(line, 1, len, f);
+		written += (size_t)len * run;
+	}
+	fclose(f);
+}
+
+static double parse_ns(int n){
+	static const char *line = "grep -e \"two words\" -n src/*.c | sort -k2 | uniq -c > counts.txt";
+	char buf[256];
+	double t = 1e300;
+	for(int r = 0; r < REPEATS; r++){
+		double start = now_ns();
+		for(int i = 0; i < n; i++){
+			strcpy(buf, line);
+			struct command_t *command = alloc_command();
+			parse_command(buf, command);
+			free_command(command);
+		}
+		t = best(t, (now_ns() - start) / n);
+	}
+	return t;
+}
+
+//Time n runs of one parsed line through process_command
+static double process_ns(const char *line, int n){
+	char buf[256];
+	strcpy(buf, line);
+	struct command_t *command = alloc_command();
+	parse_command(buf, command);
+	double t = 1e300;
+	for(int r = 0; r < REPEATS; r++){
+		double start = now_ns();
+		for(int i = 0; i < n; i++)
+			process_command(command);
+		t = best(t, (now_ns() - start) / n);
+	}
+	free_command(command);
+	return t;
+}
+
+static double pipeline_mb_s(const char *path, size_t bytes, int stages){
+	char line[PATH_MAX + 256];
+	int len = snprintf(line, sizeof(line), "cat %s", path);
+	for(int i = 1; i < stages; i++)
+		len += snprintf(line + len, sizeof(line) - len, " | cat");
+	snprintf(line + len, sizeof(line) - len, " > /dev/null");
+	double t = 1e300;
+	for(int r = 0; r < REPEATS; r++){
+		double start = now_ns();
+		run_line(line, strlen(line));
+		t = best(t, now_ns() - start);
+	}
+	return bytes / (t / 1e9) / 1e6;
+}
+
+static double uniq_mb_s(const char *path, size_t bytes){
+	char buf[] = "uniq -c";
+	struct command_t *command = alloc_command();
+	parse_command(buf, command);
+	const struct builtin *b = builtin_lookup("uniq");
+	int null = open("/dev/null", O_WRONLY);
+	double t = 1e300;
+	for(int r = 0; r < REPEATS; r++){
+		int fd = open(path, O_RDONLY);
+		double start = now_ns();
+		b->run(command, fd, null);
+		t = best(t, now_ns() - start);
+		close(fd);
+	}
+	close(null);
+	free_command(command);
+	return bytes / (t / 1e9) / 1e6;
+}
+
+static double lookup_ns(int n){
+	static const char *names[] = { "cd", "sort", "uniq", "ls", "grep", "exit", "kill", "cat" };
+	volatile const struct builtin *sink;
+	double t = 1e300;
+	for(int r = 0; r < REPEATS; r++){
+		double start = now_ns();
+		for(int i = 0; i < n; i++)
+			sink = builtin_lookup(names[i & 7]);
+		t = best(t, (now_ns() - start) / n);
+	}
+	(void)sink;
+	return t;
+}
+
+int main(int argc, char *argv[]){
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+	size_t bytes = mb << 20;
+	const char *tmp = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	const char *commit = getenv("BENCH_COMMIT") ? getenv("BENCH_COMMIT") : "unknown";
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/suite_bench.%d.txt", tmp, (int)getpid());
+	generate(path, bytes);
+	struct stat st;
+	stat(path, &st);
+	bytes = st.st_size;
+
+	double parse = parse_ns(200000);
+	double launch = process_ns("true", 300) / 1e3;
+	double pipe2_ = pipeline_mb_s(path, bytes, 2);
+	double pipe4 = pipeline_mb_s(path, bytes, 4);
+	double pipe8 = pipeline_mb_s(path, bytes, 8);
+	double uniq = uniq_mb_s(path, bytes);
+	double lookup = lookup_ns(1000000);
+	double dispatch = process_ns("set -o pipefail", 1000000);
+	unlink(path);
+
+	printf("{\n");
+	printf("  \"commit\": \"%s\",\n", commit);
+	printf("  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	printf("  \"data_mb\": %zu,\n", mb);
+	printf("  \"parse_ns_per_line\": %.1f,\n", parse);
+	printf("  \"launch_us\": %.1f,\n", launch);
+	printf("  \"pipeline_mb_s\": { \"2\": %.1f, \"4\": %.1f, \"8\": %.1f },\n", pipe2_, pipe4, pipe8);
+	printf("  \"uniq_mb_s\": %.1f,\n", uniq);
+	printf("  \"builtin_lookup_ns\": %.1f,\n", lookup);
+	printf("  \"builtin_dispatch_ns\": %.1f\n", dispatch);
+	printf("}\n");
+	return 0;
+}
@@ -0,0 +1,116 @@
+/**
+ * myuniq -c throughput against an fgets/strcmp loop (the input path myuniq
+ * used to have) and GNU uniq -c, over a generated sorted file.
+ *
+ * Build: gcc -O2 -o uniq_bench bench/uniq_bench.c
+ * Usage: ./uniq_bench [size-in-MB] (default 1024, file goes to $TMPDIR)
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+#include "bench.h"
+
+//Sorted access-log style lines, runs of 1-8 duplicates
+static void generate(const char *path, size_t bytes){
+	FILE *f = fopen(path, "w");
+	size_t written = 0;
+	unsigned long id = 0;
+	srand(304);
+	while(written < bytes){
+		int run = 1 + rand() % 8;
+		char line[128];
+		int len = snprintf(line, sizeof(line), "2022-11-17T12:00:00 GET /comp304/shellax/%010lu HTTP/1.1 200\n", id++);
+		for(int i = 0; i < run; i++)
+			fwrite(line, 1, len, f);
+		written += (size_t)len * run;
+	}
+	fclose(f);
+}
+
+static double fgets_uniq(const char *path){
+	char prev[4096] = "", cur[4096];
+	unsigned long count = 0;
+	FILE *in = fopen(path, "r"), *out = fopen("/dev/null", "w");
+	double start = now_s();
+	while(fgets(cur, sizeof(cur), in) != NULL){
+		if(count > 0 && strcmp(prev, cur) == 0){
+			count++;
+			continue;
+		}
+		if(count > 0)
+			fprintf(out, "\t%lu %s", count, prev);
+		strcpy(prev, cur);
+		count = 1;
+	}
+	if(count > 0)
+		fprintf(out, "\t%lu %s", count, prev);
+	double t = now_s() - start;
+	fclose(in);
+	fclose(out);
+	return t;
+}
+
+static double shell_uniq(const char *path, bool through_pipe){
+	char line[PATH_MAX + 16];
+	snprintf(line, sizeof(line), "uniq -c %s", through_pipe ? "" : path);
+	struct command_t *command = alloc_command();
+	parse_command(line, command);
+	int out = open("/dev/null", O_WRONLY);
+	int in = STDIN_FILENO;
+	pid_t feeder = 0;
+	if(through_pipe){ //feed it from a cat process like a pipeline stage would be
+		int fd[2];
+		pipe(fd);
+		feeder = fork();
+		if(feeder == 0){
+			dup2(fd[1], STDOUT_FILENO);
+			close(fd[0]);
+			execlp("cat", "cat", path, (char *)NULL);
+			_exit(127);
+		}
+		close(fd[1]);
+		in = fd[0];
+	}
+	double start = now_s();
+	myuniq(command, in, out);
+	double t = now_s() - start;
+	if(through_pipe){
+		close(in);
+		waitpid(feeder, NULL, 0);
+	}
+	close(out);
+	free_command(command);
+	return t;
+}
+
+static double gnu_uniq(const char *path){
+	double start = now_s();
+	pid_t pid = fork();
+	if(pid == 0){
+		int out = open("/dev/null", O_WRONLY);
+		dup2(out, STDOUT_FILENO);
+		execlp("uniq", "uniq", "-c", path, (char *)NULL);
+		_exit(127);
+	}
+	waitpid(pid, NULL, 0);
+	return now_s() - start;
+}
+
+int main(int argc, char *argv[]){
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/shellax-uniq-bench.txt", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	generate(path, mb << 20);
+	fgets_uniq(path); //warm the page cache
+
+	printf("%-22s %10s %10s\n", "path", "seconds", "MB/s");
+	double t = fgets_uniq(path);
+	printf("%-22s %10.3f %10.1f\n", "fgets+strcmp", t, mb / t);
+	t = shell_uniq(path, false);
+	printf("%-22s %10.3f %10.1f\n", "myuniq mmap", t, mb / t);
+	t = shell_uniq(path, true);
+	printf("%-22s %10.3f %10.1f\n", "myuniq pipe", t, mb / t);
+	t = gnu_uniq(path);
+	printf("%-22s %10.3f %10.1f\n", "GNU uniq", t, mb / t);
+	unlink(path);
+	return 0;
+}
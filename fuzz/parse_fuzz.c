@@ -0,0 +1,63 @@
+/**
+ * libFuzzer target for the lexer and parse_command. Each input is parsed as
+ * one command line and every string of the resulting pipeline is read back,
+ * so AddressSanitizer sees any token that points outside the line.
+ *
+ * Build: clang -g -O1 -fsanitize=fuzzer,address -o parse_fuzz fuzz/parse_fuzz.c
+ * Usage: ./parse_fuzz [corpus-dir]
+ *
+ * Without libFuzzer (e.g. gcc), define PARSE_FUZZ_MAIN to get a driver that
+ * runs each file given on the command line through the target once:
+ *        gcc -g -fsanitize=address -DPARSE_FUZZ_MAIN -pthread -o parse_fuzz fuzz/parse_fuzz.c
+ */
+#define SHELLAX_NO_MAIN
+#include "../shellax-skeleton.c"
+
+static size_t touch(const char *s){
+	return s == NULL ? 0 : strlen(s);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+	//prompt() hands parse_command a NUL terminated line
+	char *buf = malloc(size + 1);
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+
+	struct command_t *command = alloc_command();
+	parse_command(buf, command);
+	size_t total = 0;
+	for(struct command_t *c = command; c != NULL; c = c->next){
+		total += touch(c->name);
+		for(int i = 0; i < c->arg_count; i++)
+			total += touch(c->args[i]);
+		if(c->argv[0] != c->name || c->argv[c->arg_count + 1] != NULL)
+			abort();
+		for(int i = 0; i < c->redirect_count; i++){
+			if(c->redirects[i].op > REDIRECT_ALL_APPEND)
+				abort();
+			total += touch(c->redirects[i].target);
+		}
+	}
+	if(total > size) // dequoting only ever shrinks a word
+		abort();
+	free_command(command);
+	free(buf);
+	return 0;
+}
+
+#ifdef PARSE_FUZZ_MAIN
+int main(int argc, char *argv[]){
+	for(int i = 1; i < argc; i++){
+		FILE *f = fopen(argv[i], "rb");
+		if(f == NULL){
+			printf("-parse_fuzz: %s: %s\n", argv[i], strerror(errno));
+			continue;
+		}
+		static uint8_t data[1 << 20];
+		size_t size = fread(data, 1, sizeof(data), f);
+		fclose(f);
+		LLVMFuzzerTestOneInput(data, size);
+	}
+	return 0;
+}
+#endif
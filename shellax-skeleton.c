@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // posix_spawn_file_actions_addtcsetpgrp_np, pipe2
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
@@ -5,14 +6,42 @@
 #include <stdlib.h>
 #include <termios.h> // termios, TCSANOW, ECHO, ICANON
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdbool.h>
 #include <time.h>
 #include <dirent.h>
 #include <errno.h>
-#include <time.h>
+#include <limits.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <locale.h>
+#include <wchar.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#include <spawn.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <linux/perf_event.h>
 
 const char * sysname = "shellax";
+static int last_status; // exit status of the last foreground pipeline
+static bool pipefail; // set -o pipefail
+static bool job_control; // interactive: jobs can be stopped and moved between fg and bg
 
 enum return_codes {
 	SUCCESS = 0,
@@ -20,16 +49,291 @@ enum return_codes {
 	UNKNOWN = 2,
 };
 
+enum redirect_op { // in the order of their tokens
+	REDIRECT_IN, // <
+	REDIRECT_OUT, // >
+	REDIRECT_APPEND, // >>
+	REDIRECT_ERR, // 2>
+	REDIRECT_ERR_APPEND, // 2>>
+	REDIRECT_ERR_TO_OUT, // 2>&1
+	REDIRECT_ALL, // &>
+	REDIRECT_ALL_APPEND, // &>>
+};
+
+static const struct {
+	const char *text;
+	int fd; // the fd it replaces, &> also copies it to 2
+	int flags; // open flags, unused by 2>&1
+} redirect_ops[] = {
+	[REDIRECT_IN] = { "<", STDIN_FILENO, O_RDONLY },
+	[REDIRECT_OUT] = { ">", STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC },
+	[REDIRECT_APPEND] = { ">>", STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND },
+	[REDIRECT_ERR] = { "2>", STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC },
+	[REDIRECT_ERR_APPEND] = { "2>>", STDERR_FILENO, O_WRONLY | O_CREAT | O_APPEND },
+	[REDIRECT_ERR_TO_OUT] = { "2>&1", STDERR_FILENO, 0 },
+	[REDIRECT_ALL] = { "&>", STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC },
+	[REDIRECT_ALL_APPEND] = { "&>>", STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND },
+};
+
+struct redirect {
+	enum redirect_op op;
+	char *target; // file name, NULL for 2>&1
+};
+
+//What a stage's fds 0, 1 and 2 become once its pipe ends and redirections are applied
+struct redirection {
+	int fd[3];
+	bool owned[3]; // opened for the stage, closed by redirect_close
+};
+
 struct command_t {
 	char *name;
 	bool background;
 	bool auto_complete;
 	int arg_count;
 	char **args;
-	char *redirects[3]; // in/out redirection
+	char **argv; // name followed by args and NULL, ready for exec (args == argv+1)
+	struct redirect *redirects; // applied left to right
+	int redirect_count;
 	struct command_t *next; // for piping
 };
 
+//TRACE: `trace on|off|dump <file>` records timestamped spans of parsing,
+//redirect setup, spawning, builtins, waiting and child lifetimes into a ring
+//any thread appends to without a lock. dump writes Chrome trace-event JSON,
+//which Perfetto and chrome://tracing open. While tracing is off every probe
+//is one load and a branch predicted not taken.
+#define TRACE_RING_SIZE 65536 // events, power of two; the oldest are overwritten
+#define TRACE_DETAIL 48
+
+struct trace_event {
+	uint64_t seq; // index + 1 once written, 0 while it is being written
+	uint64_t start, dur; // ns, CLOCK_MONOTONIC
+	const char *name; // a string literal
+	int tid; // recording thread, or the child's pid for its lifetime
+	char detail[TRACE_DETAIL];
+};
+
+static bool trace_enabled;
+static struct trace_event *trace_ring; // allocated by the first trace on, kept for dump
+static uint64_t trace_head; // events ever recorded since trace on
+static uint64_t trace_epoch; // when tracing was turned on, ts 0 of the dump
+
+#define TRACE_ON() __builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED), 0)
+//Start a span: t is its start time, 0 when tracing is off
+#define TRACE_BEGIN(t) uint64_t t = TRACE_ON() ? trace_clock() : 0
+#define TRACE_END(t, name, detail) do { \
+		if(__builtin_expect((t) != 0, 0)) trace_record(name, detail, t, gettid()); \
+	} while(0)
+
+static uint64_t trace_clock(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Append a span ending now. The slot is claimed with one atomic add; its
+ * sequence number is cleared while it is filled so dump skips it
+ * @param name   what ran
+ * @param detail command name or path, may be NULL
+ * @param start  from TRACE_BEGIN
+ * @param tid    track to show it on
+ */
+static void trace_record(const char *name, const char *detail, uint64_t start, int tid){
+	uint64_t end = trace_clock();
+	uint64_t i = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	struct trace_event *e = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->start = start;
+	e->dur = end - start;
+	e->name = name;
+	e->tid = tid;
+	snprintf(e->detail, TRACE_DETAIL, "%s", detail ? detail : "");
+	__atomic_store_n(&e->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+static void trace_json_string(FILE *f, const char *s){
+	fputc('"', f);
+	for(; *s; s++){
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/**
+ * Write the ring, oldest first, as a Chrome trace. Events still being
+ * written, or overwritten while being copied, are left out
+ * @param  path file to write
+ * @return      0 or 1 when it cannot be written
+ */
+static int trace_dump(const char *path){
+	FILE *f = fopen(path, "w");
+	if(f == NULL){
+		printf("-%s: trace: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
+	}
+	int pid = getpid();
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, sysname);
+	fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"shell\"}}", pid, pid);
+	uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	unsigned long written = 0;
+	for(uint64_t i = first; trace_ring != NULL && i < head; i++){
+		struct trace_event *slot = &trace_ring[i & (TRACE_RING_SIZE - 1)], e;
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1)
+			continue;
+		e = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1)
+			continue;
+		e.detail[TRACE_DETAIL - 1] = '\0';
+		if(strcmp(e.name, "process") == 0){ // a child gets its own named track
+			fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", pid, e.tid);
+			trace_json_string(f, e.detail);
+			fprintf(f, "}}");
+		}
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"detail\":", e.name, sysname, (e.start - trace_epoch) / 1e3, e.dur / 1e3, pid, e.tid);
+		trace_json_string(f, e.detail);
+		fprintf(f, "}}");
+		written++;
+	}
+	fprintf(f, "\n]}\n");
+	if(fclose(f) != 0){
+		printf("-%s: trace: %s: %s\n", sysname, path, strerror(errno));
+		return 1;
+	}
+	printf("%lu events written to %s", written, path);
+	if(first > 0)
+		printf(", %llu older ones were overwritten", (unsigned long long)first);
+	printf("\n");
+	return 0;
+}
+
+static int trace_builtin(struct command_t *command, int in_fd, int out_fd){
+	const char *op = command->arg_count > 0 ? command->args[0] : "";
+	if(strcmp(op, "on") == 0){
+		if(trace_ring == NULL)
+			trace_ring = calloc(TRACE_RING_SIZE, sizeof(struct trace_event));
+		if(trace_ring == NULL){
+			printf("-%s: trace: %s\n", sysname, strerror(errno));
+			return 1;
+		}
+		if(!trace_enabled){ // start a fresh trace
+			memset(trace_ring, 0, TRACE_RING_SIZE * sizeof(struct trace_event));
+			trace_head = 0;
+			trace_epoch = trace_clock();
+		}
+		__atomic_store_n(&trace_enabled, true, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if(strcmp(op, "off") == 0){
+		__atomic_store_n(&trace_enabled, false, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if(strcmp(op, "dump") == 0 && command->arg_count == 2)
+		return trace_dump(command->args[1]);
+	if(op[0] == '\0'){
+		uint64_t n = trace_head;
+		printf("trace %s, %llu events recorded\n", trace_enabled ? "on" : "off", (unsigned long long)n);
+		return 0;
+	}
+	printf("-%s: trace: usage: trace on|off|dump <file>\n", sysname);
+	return 2;
+}
+
+//ARENA ALLOCATOR: bump allocation out of large chunks, released all at once
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size, used;
+	char data[];
+};
+
+struct arena {
+	struct arena_chunk *head;
+	size_t total; // bytes held in chunks
+};
+
+/**
+ * Allocate n bytes, 16 byte aligned, that live until the arena is reset
+ * @param  a arena
+ * @param  n size
+ * @return   memory, never NULL
+ */
+static void *arena_alloc(struct arena *a, size_t n){
+	n = (n + 15) & ~(size_t)15;
+	struct arena_chunk *c = a->head;
+	if(c == NULL || c->size - c->used < n){
+		size_t size = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+		c = malloc(sizeof(struct arena_chunk) + size);
+		if(c == NULL){
+			perror(sysname);
+			exit(1);
+		}
+		c->size = size;
+		c->used = 0;
+		c->next = a->head;
+		a->head = c;
+		a->total += size;
+	}
+	void *p = c->data + c->used;
+	c->used += n;
+	return p;
+}
+
+//Drop everything but keep the newest chunk for reuse
+static void arena_reset(struct arena *a){
+	if(a->head == NULL) return;
+	struct arena_chunk *c = a->head->next;
+	while(c){
+		struct arena_chunk *next = c->next;
+		free(c);
+		c = next;
+	}
+	a->head->next = NULL;
+	a->head->used = 0;
+	a->total = a->head->size;
+}
+
+static void arena_free(struct arena *a){
+	arena_reset(a);
+	free(a->head);
+	a->head = NULL;
+	a->total = 0;
+}
+
+static char *arena_strndup(struct arena *a, const char *s, size_t n){
+	char *copy = arena_alloc(a, n + 1);
+	memcpy(copy, s, n);
+	copy[n] = '\0';
+	return copy;
+}
+
+//Everything parsed from one input line, the whole next chain included, lives
+//here; free_command releases it with a single reset
+static struct arena command_arena;
+
+/**
+ * A zeroed command in the command arena
+ * @return [description]
+ */
+struct command_t *alloc_command()
+{
+	struct command_t *command=arena_alloc(&command_arena, sizeof(struct command_t));
+	memset(command, 0, sizeof(struct command_t));
+	return command;
+}
+
 /**
  * Prints a command struct
  * @param struct command_t *
@@ -41,8 +345,9 @@ void print_command(struct command_t * command)
 	printf("\tIs Background: %s\n", command->background?"yes":"no");
 	printf("\tNeeds Auto-complete: %s\n", command->auto_complete?"yes":"no");
 	printf("\tRedirects:\n");
-	for (i=0;i<3;i++)
-		printf("\t\t%d: %s\n", i, command->redirects[i]?command->redirects[i]:"N/A");
+	for (i=0;i<command->redirect_count;i++)
+		printf("\t\t%s %s\n", redirect_ops[command->redirects[i].op].text,
+				command->redirects[i].target?command->redirects[i].target:"");
 	printf("\tArguments (%d):\n", command->arg_count);
 	for (i=0;i<command->arg_count;++i)
 		printf("\t\tArg %d: %s\n", i, command->args[i]);
@@ -61,334 +366,1086 @@ void print_command(struct command_t * command)
  */
 int free_command(struct command_t *command)
 {
-	if (command->arg_count)
-	{
-		for (int i=0; i<command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
-	}
-	for (int i=0;i<3;++i)
-		if (command->redirects[i])
-			free(command->redirects[i]);
-	if (command->next)
-	{
-		free_command(command->next);
-		command->next=NULL;
-	}
-	free(command->name);
-	free(command);
-	return 0;
-}
-/**
- * Show the command prompt
- * @return [description]
- */
-int show_prompt()
-{
-	char cwd[1024], hostname[1024];
-	gethostname(hostname, sizeof(hostname));
-	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	arena_reset(&command_arena); // the command, its args, redirects and pipe stages
 	return 0;
 }
-/**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
- */
-int parse_command(char *buf, struct command_t *command)
-{
-	const char *splitters=" \t"; // split at whitespace
-	int index, len;
-	len=strlen(buf);
-	while (len>0 && strchr(splitters, buf[0])!=NULL) // trim left whitespace
-	{
-		buf++;
-		len--;
-	}
-	while (len>0 && strchr(splitters, buf[len-1])!=NULL)
-		buf[--len]=0; // trim right whitespace
+//LEXER: one pass over the input line, tokens are (offset, length) into it
+enum token_type {
+	TOKEN_END,
+	TOKEN_WORD,
+	TOKEN_PIPE, // |
+	TOKEN_AMP, // &
+	TOKEN_IN, // <
+	TOKEN_OUT, // >
+	TOKEN_APPEND, // >>
+	TOKEN_ERR, // 2>
+	TOKEN_ERR_APPEND, // 2>>
+	TOKEN_ERR_TO_OUT, // 2>&1
+	TOKEN_ALL, // &>
+	TOKEN_ALL_APPEND, // &>>
+};
 
-	if (len>0 && buf[len-1]=='?') // auto-complete
-		command->auto_complete=true;
-	if (len>0 && buf[len-1]=='&') // background
-		command->background=true;
+struct token {
+	enum token_type type;
+	int offset;
+	int len;
+};
 
-	char *pch = strtok(buf, splitters);
-	command->name=(char *)malloc(strlen(pch)+1);
-	if (pch==NULL)
-		command->name[0]=0;
-	else
-		strcpy(command->name, pch);
+struct lexer {
+	char *buf;
+	int pos;
+	char next; // byte at pos; the previous word's terminator may have overwritten it
+};
 
-	command->args=(char **)malloc(sizeof(char *));
+static void lex_init(struct lexer *lx, char *buf){
+	lx->buf = buf;
+	lx->pos = 0;
+	lx->next = buf[0];
+}
 
-	int redirect_index;
-	int arg_index=0;
-	char temp_buf[1024], *arg;
-	while (1)
-	{
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch) break;
-		arg=temp_buf;
-		strcpy(arg, pch);
-		len=strlen(arg);
-
-		if (len==0) continue; // empty arg, go for next
-		while (len>0 && strchr(splitters, arg[0])!=NULL) // trim left whitespace
-		{
-			arg++;
-			len--;
-		}
-		while (len>0 && strchr(splitters, arg[len-1])!=NULL) arg[--len]=0; // trim right whitespace
-		if (len==0) continue; // empty arg, go for next
+static bool lex_blank(char c){
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
 
-		// piping to another command
-		if (strcmp(arg, "|")==0)
-		{
-			struct command_t *c=malloc(sizeof(struct command_t));
-			int l=strlen(pch);
-			pch[l]=splitters[0]; // restore strtok termination
-			index=1;
-			while (pch[index]==' ' || pch[index]=='\t') index++; // skip whitespaces
+static bool lex_delimiter(char c){
+	return c == '\0' || lex_blank(c) || c == '|' || c == '&' || c == '<' || c == '>';
+}
 
-			parse_command(pch+index, c);
-			pch[l]=0; // put back strtok termination
-			command->next=c;
-			continue;
+/**
+ * Read the next token. Words are dequoted and unescaped in place: the bytes
+ * are written back over the word itself, which can only shrink, and then
+ * NUL terminated, so buf+offset is the finished string. The terminator lands
+ * at or before the delimiter that ended the word, which is kept in lx->next.
+ * @param  lx lexer state
+ * @param  t  filled with the token
+ * @return    the token type
+ */
+static enum token_type lex_next(struct lexer *lx, struct token *t){
+	char *b = lx->buf;
+	int r = lx->pos;
+	char c = lx->next;
+	while(lex_blank(c))
+		c = b[++r];
+	t->offset = r;
+	t->len = 1;
+	switch(c){
+	case '#': // comment, the rest of the line is ignored
+	case '\0':
+		t->len = 0;
+		t->type = TOKEN_END;
+		break;
+	case '|':
+		t->type = TOKEN_PIPE;
+		break;
+	case '&':
+		t->type = TOKEN_AMP;
+		if(b[r+1] == '>'){
+			t->type = b[r+2] == '>' ? TOKEN_ALL_APPEND : TOKEN_ALL;
+			t->len = t->type == TOKEN_ALL_APPEND ? 3 : 2;
 		}
+		break;
+	case '<':
+		t->type = TOKEN_IN;
+		break;
+	case '>':
+		t->type = b[r+1] == '>' ? TOKEN_APPEND : TOKEN_OUT;
+		t->len = t->type == TOKEN_APPEND ? 2 : 1;
+		break;
+	default:
+		if(c == '2' && b[r+1] == '>' && b[r+2] == '&' && b[r+3] == '1'){
+			t->type = TOKEN_ERR_TO_OUT;
+			t->len = 4;
+			break;
+		}
+		if(c == '2' && b[r+1] == '>'){
+			t->type = b[r+2] == '>' ? TOKEN_ERR_APPEND : TOKEN_ERR;
+			t->len = t->type == TOKEN_ERR_APPEND ? 3 : 2;
+			break;
+		}
+		t->type = TOKEN_WORD;
+	}
+	if(t->type != TOKEN_WORD){
+		lx->pos = r + t->len;
+		lx->next = b[lx->pos];
+		return t->type;
+	}
 
-		// background process
-		if (strcmp(arg, "&")==0)
-			continue; // handled before
-
-		// handle input redirection
-		redirect_index=-1;
-		if (arg[0]=='<')
-			redirect_index=0;
-		if (arg[0]=='>')
-		{
-			if (len>1 && arg[1]=='>')
-			{
-				redirect_index=2;
-				arg++;
-				len--;
+	int w = r;
+	char quote = 0;
+	for(;; c = b[++r]){
+		if(c == '\0')
+			break; // an unterminated quote runs to the end of the line
+		if(quote){
+			if(c == quote){
+				quote = 0;
+				continue;
 			}
-			else redirect_index=1;
+			if(quote == '"' && c == '\\' && b[r+1] != '\0' && strchr("\"\\$`", b[r+1]) != NULL)
+				c = b[++r];
+			b[w++] = c;
+			continue;
 		}
-		if (redirect_index != -1)
-		{
-			command->redirects[redirect_index]=malloc(len);
-			strcpy(command->redirects[redirect_index], arg+1);
+		if(lex_delimiter(c))
+			break;
+		if(c == '"' || c == '\''){
+			quote = c;
 			continue;
 		}
-
-		// normal arguments
-		if (len>2 && ((arg[0]=='"' && arg[len-1]=='"')
-					|| (arg[0]=='\'' && arg[len-1]=='\''))) // quote wrapped arg
-		{
-			arg[--len]=0;
-			arg++;
+		if(c == '\\'){
+			if(b[r+1] == '\0')
+				continue; // trailing backslash
+			c = b[++r];
 		}
-		command->args=(char **)realloc(command->args, sizeof(char *)*(arg_index+1));
-		command->args[arg_index]=(char *)malloc(len+1);
-		strcpy(command->args[arg_index++], arg);
+		b[w++] = c;
 	}
-	command->arg_count=arg_index;
-	return 0;
+	lx->pos = r;
+	lx->next = c;
+	b[w] = '\0';
+	t->len = w - t->offset;
+	return t->type;
 }
 
-void prompt_backspace()
-{
-	putchar(8); // go back 1
-	putchar(' '); // write empty over
-	putchar(8); // go back 1 again
-}
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Close off a pipeline stage: the name goes in argv[0], args points past it
+ * @param command  stage being built
+ * @param arg_count number of arguments collected
  */
-int prompt(struct command_t *command)
-{
-	int index=0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
+static void finish_stage(struct command_t *command, int arg_count){
+	if(command->name == NULL)
+		command->name = arena_strndup(&command_arena, "", 0);
+	command->argv[0] = command->name;
+	command->argv[arg_count+1] = NULL;
+	command->args = command->argv + 1;
+	command->arg_count = arg_count;
+}
 
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+//Append a redirection to a stage, the array grows in the arena like argv
+static void stage_redirect(struct command_t *stage, enum redirect_op op, char *target){
+	int n = stage->redirect_count;
+	if((n & (n - 1)) == 0){ // 0 or a power of two: full
+		struct redirect *r = arena_alloc(&command_arena, sizeof(struct redirect) * (n ? n * 2 : 1));
+		if(n > 0)
+			memcpy(r, stage->redirects, sizeof(struct redirect) * n);
+		stage->redirects = r;
+	}
+	stage->redirects[stage->redirect_count++] = (struct redirect){ op, target };
+}
 
+/**
+ * Parse a command string into a command struct. Strings in the result point
+ * into buf, which is modified and has to outlive the command
+ * @param  buf     [description]
+ * @param  command [description]
+ * @return         0
+ */
+int parse_command(char *buf, struct command_t *command)
+{
+	TRACE_BEGIN(trace_start);
+	struct lexer lx;
+	struct token t;
+	struct command_t *stage=command;
+	int arg_cap=8; // argv keeps room for the name and the NULL terminator
+	int arg_index=0;
+	bool last_question=false;
+	lex_init(&lx, buf);
+	stage->argv=arena_alloc(&command_arena, sizeof(char *)*(arg_cap+2));
 
-	//FIXME: backspace is applied before printing chars
-	show_prompt();
-	int multicode_state=0;
-	buf[0]=0;
-	while (1)
+	enum token_type type=lex_next(&lx, &t);
+	while (type!=TOKEN_END)
 	{
-		c=getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-		if (c==9) // handle tab
+		char *word=buf+t.offset;
+		last_question=false;
+		switch (type)
 		{
-			buf[index++]='?'; // autocomplete
+		case TOKEN_WORD:
+			last_question=t.len>0 && word[t.len-1]=='?';
+			if (stage->name==NULL)
+			{
+				stage->name=word;
+				break;
+			}
+			if (arg_index==arg_cap) // grow, the old array just stays in the arena
+			{
+				char **argv=arena_alloc(&command_arena, sizeof(char *)*(arg_cap*2+2));
+				memcpy(argv, stage->argv, sizeof(char *)*(arg_cap+1));
+				stage->argv=argv;
+				arg_cap*=2;
+			}
+			stage->argv[++arg_index]=word;
 			break;
-		}
-
-		if (c==127) // handle backspace
+		case TOKEN_PIPE: // piping to another command
+			finish_stage(stage, arg_index);
+			stage->next=alloc_command();
+			stage=stage->next;
+			arg_cap=8;
+			arg_index=0;
+			stage->argv=arena_alloc(&command_arena, sizeof(char *)*(arg_cap+2));
+			break;
+		case TOKEN_AMP: // background process
+			command->background=true;
+			break;
+		case TOKEN_ERR_TO_OUT:
+			stage_redirect(stage, REDIRECT_ERR_TO_OUT, NULL);
+			break;
+		default: // redirection, the target is the next word
 		{
-			if (index>0)
+			enum redirect_op op=type-TOKEN_IN;
+			type=lex_next(&lx, &t);
+			if (type==TOKEN_WORD)
 			{
-				prompt_backspace();
-				index--;
+				stage_redirect(stage, op, buf+t.offset);
+				type=lex_next(&lx, &t);
 			}
-			continue;
+			continue; // a missing target just drops the operator
 		}
-		if (c == 27 || c == 91 || c ==67 || c == 68) // handle multi-code keys
-		{
-			continue;
 		}
-
-		if (c==65) // up arrow
-		{
-			while (index>0)
-			{
-				prompt_backspace();
-				index--;
-			}	
-
-			char tmpbuf[4096];
-			printf("%s", oldbuf);
-			strcpy(tmpbuf, buf);
-			strcpy(buf, oldbuf);
-			strcpy(oldbuf, tmpbuf);
-			index += strlen(buf);
-			continue;
-		}	
-
-		putchar(c); // echo the character
-		buf[index++]=c;
-		if (index>=sizeof(buf)-1) break;
-		if (c=='\n') // enter key
-			break;
-		if (c==4) // Ctrl+D
-			return EXIT;
+		type=lex_next(&lx, &t);
 	}
-	if (index>0 && buf[index-1]=='\n') // trim newline from the end
-		index--;
-	buf[index++]='\0'; // null terminate string
+	finish_stage(stage, arg_index);
+	command->auto_complete=last_question;
+	TRACE_END(trace_start, "parse", command->name);
+	return 0;
+}
 
-	strcpy(oldbuf, buf);
+//LINE EDITOR: raw mode input read in bulk, escape sequences decoded by a
+//state machine, and every batch of input redrawn with a single write()
+enum editor_state {
+	ED_NORMAL,
+	ED_ESC, // saw ESC
+	ED_CSI, // saw ESC [, collecting parameters
+	ED_SS3, // saw ESC O
+};
 
-	parse_command(buf, command);
+enum editor_result {
+	ED_MORE, // keep reading
+	ED_SUBMIT, // line is done
+	ED_EOF, // Ctrl+D on an empty line
+};
 
-	// print_command(command); // DEBUG: uncomment for debugging
+struct line_editor {
+	char *buf; // the line being edited, NUL terminated
+	size_t len, cap, pos; // pos is the cursor
+	uint32_t hist_age; // 0 while on the edited line, n while showing the nth newest entry
+	char *stash; // the edited line while browsing or searching history
+	bool searching; // Ctrl+R incremental search
+	char *query;
+	size_t query_len, query_cap;
+	uint32_t match_age; // entry the search is showing, 0 if none
+	bool tabbed; // the last key was a Tab that could not complete any further
+	enum editor_state state;
+	char seq[16]; // CSI parameters collected so far
+	int seq_len;
+	bool paste; // inside a bracketed paste everything but the end marker is literal
+	char in[4096]; // input read but not consumed yet, kept for the next prompt
+	size_t in_start, in_len;
+	char *out; // the frame being built
+	size_t out_len, out_cap;
+	char prompt[2200];
+	size_t prompt_len;
+	size_t cols;
+	size_t cursor_row; // screen row of the cursor, counted from the prompt's row
+	size_t drawn; // bytes of buf on screen; appending past them needs no redraw
+	bool redraw;
+};
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-	return SUCCESS;
-}
-int pipe_command(struct command_t *command, char *pathname, int *fd);
-void rps(struct command_t *command);
-void guessTheNumber(struct command_t *command);	
-int myuniq(struct command_t *command);
-void wiseman(struct command_t *command);
-int io_redirect(struct command_t *command);
-int process_command(struct command_t *command);
-int main()
-{
-	while (1)
-	{
-		struct command_t *command=malloc(sizeof(struct command_t));
-		memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+static struct line_editor editor;
 
-		int code;
-		code = prompt(command);
-		if (code==EXIT) break;
+//HISTORY: defined after main
+uint32_t hist_count();
+const char *hist_get(uint32_t age, size_t *len);
+void hist_sync();
+void hist_add(const char *line, size_t len);
+uint32_t hist_search(const char *query, size_t qlen, uint32_t from_age);
 
-		code = process_command(command);
-		if (code==EXIT) break;
+//JOB CONTROL: defined after main
+void job_notify();
+void job_reap();
+int job_event_fd();
 
-		free_command(command);
-	}
+//TAB COMPLETION: defined after main
+size_t complete_word(const char *word, size_t len, bool command, const char ***matches);
 
-	printf("\n");
-	return 0;
+/**
+ * Format the command prompt
+ * @param  out  where to write it
+ * @param  size size of out
+ * @return      its length
+ */
+size_t format_prompt(char *out, size_t size)
+{
+	char cwd[1024], hostname[1024];
+	gethostname(hostname, sizeof(hostname));
+	getcwd(cwd, sizeof(cwd));
+	int n=snprintf(out, size, "%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
+	return n < 0 ? 0 : (size_t)n >= size ? size-1 : (size_t)n;
 }
 
-//HELPER METHODS
-void rps(struct command_t *command){
-	int n;
-	char pc; 
-	char pcStr[10];
-	char user[10];
-	char userStr[10];
-	srand(time(NULL)); //calculate random number btween 1-100
-	n = rand() % 100;
-	if(n < 33){ //choose r, p or s according to the number generated 
-		pc = 'r'; 
-		strcpy(pcStr, "ROCK");
-	} else if (n > 33 && n < 66){
-		pc = 'p';
-		strcpy(pcStr, "PAPER");
-	} else {
-		pc = 's';
-		strcpy(pcStr, "SCISSORS");
+static void ed_emit(const char *s, size_t n){
+	if(editor.out_len + n > editor.out_cap){
+		while(editor.out_len + n > editor.out_cap)
+			editor.out_cap = editor.out_cap ? editor.out_cap * 2 : 8192;
+		editor.out = realloc(editor.out, editor.out_cap);
 	}
+	memcpy(editor.out + editor.out_len, s, n);
+	editor.out_len += n;
+}
 
-	printf("\n\n\n\n\t\t\t\tEnter 'r' for Rock, 'p' for Paper, 's' for Scissors\n\t");	
-	
-	printf("Enter your choice: ");	//Take input from user r, p or s
-	fgets(user, sizeof(char)*10, stdin);
+static void ed_emitf(const char *format, size_t n){
+	char tmp[32];
+	int len = snprintf(tmp, sizeof(tmp), format, n);
+	ed_emit(tmp, len);
+}
 
-	while(user[0] != 'r' && user[0] != 'p' && user[0] != 's'){
-		printf("\n\tU should enter r, p or s\n");
-		
-		printf("\tEnter your choice: ");	//Take input from user r, p or s
-		fgets(user, sizeof(char)*10, stdin);
+static void ed_reserve(size_t n){
+	if(editor.len + n + 1 > editor.cap){
+		while(editor.len + n + 1 > editor.cap)
+			editor.cap = editor.cap ? editor.cap * 2 : 256;
+		editor.buf = realloc(editor.buf, editor.cap);
 	}
+}
 
-	if(user[0] == 'r'){
-		strcpy(userStr, "ROCK");
-	} else if (user[0] == 'p'){
-		strcpy(userStr, "PAPER");
-	} else {
-		strcpy(userStr, "SCISSORS");	
-	} 
-	//Game started prints
-	printf("\tYou choose: %s\n", userStr);	
-	sleep(1); //Sleep calls added to make the game feel realistic
-	printf("\t\t\t\t\tROCK!\n");
-	sleep(1);
-	printf("\t\t\t\t\t\tPAPER!\n");
-	sleep(1);
-	printf("\t\t\t\t\t\t\tSCISSORS!\n");
-	sleep(1);
-	printf("\t\t\t\t\t\tSHOOOT!\n");
-	sleep(0.5);
-	//printf("PC: %s\n", pcStr);	
-	printf("\t\t\t\t\t   --%s vs %s--\n", pcStr, userStr);	
-	
-	//End game prints
-	if(pc == user[0]){ 
-		printf("\n\t\t\t\t\t    Its a tie\n\n");
+static void ed_insert(const char *s, size_t n){
+	ed_reserve(n);
+	if(editor.pos != editor.len){
+		memmove(editor.buf + editor.pos + n, editor.buf + editor.pos, editor.len - editor.pos);
+		editor.redraw = true;
 	}
-	else if (pc == 'r'){
-		if(user[0] == 's'){
-			printf("\n\t\t\t\t\t    Computer WINS!\n\n");
+	memcpy(editor.buf + editor.pos, s, n);
+	editor.pos += n;
+	editor.len += n;
+	editor.buf[editor.len] = '\0';
+}
+
+//Remove n bytes starting at from
+static void ed_delete(size_t from, size_t n){
+	memmove(editor.buf + from, editor.buf + from + n, editor.len - from - n);
+	editor.len -= n;
+	editor.buf[editor.len] = '\0';
+	if(editor.pos > from)
+		editor.pos = editor.pos >= from + n ? editor.pos - n : from;
+	editor.redraw = true;
+}
+
+static void ed_set(const char *s, size_t n){
+	editor.len = editor.pos = 0;
+	ed_insert(s, n);
+	editor.redraw = true;
+}
+
+static void ed_move(size_t pos){
+	if(pos != editor.pos)
+		editor.redraw = true;
+	editor.pos = pos;
+}
+
+//UTF-8 continuation bytes belong to the character before them
+static bool ed_continuation(size_t pos){
+	return pos < editor.len && ((unsigned char)editor.buf[pos] & 0xC0) == 0x80;
+}
+
+//Start of the character before pos
+static size_t ed_prev(size_t pos){
+	if(pos > 0) pos--;
+	while(pos > 0 && ed_continuation(pos)) pos--;
+	return pos;
+}
+
+//Start of the character after pos
+static size_t ed_next(size_t pos){
+	if(pos < editor.len) pos++;
+	while(ed_continuation(pos)) pos++;
+	return pos;
+}
+
+/**
+ * Advance a screen position over text the way the terminal does: each
+ * character takes its wcwidth, and a wide one that doesn't fit in what is
+ * left of the row goes to the next. A full row counts as the start of the
+ * next one, which is where the pending wrap ends up.
+ * @param s   the text
+ * @param n   its length in bytes
+ * @param row row, updated
+ * @param col column, updated
+ */
+static void ed_advance(const char *s, size_t n, size_t *row, size_t *col){
+	mbstate_t state;
+	memset(&state, 0, sizeof(state));
+	for(size_t i = 0; i < n; ){
+		wchar_t wc;
+		size_t len = mbrtowc(&wc, s + i, n - i, &state);
+		int width = 1;
+		if(len == (size_t)-1 || len == (size_t)-2){ // not valid here: a column per lead byte
+			memset(&state, 0, sizeof(state));
+			len = 1;
+			while(i + len < n && ((unsigned char)s[i + len] & 0xC0) == 0x80)
+				len++;
+		} else {
+			if(len == 0) len = 1;
+			width = wcwidth(wc);
+			if(width < 0) width = 1;
+		}
+		i += len;
+		if(*col + width > editor.cols){
+			(*row)++;
+			*col = 0;
+		}
+		*col += width;
+		if(*col >= editor.cols){
+			(*row)++;
+			*col = 0;
+		}
+	}
+}
+
+//Screen row and column of a byte offset in the line, the prompt's row being 0
+static void ed_locate(size_t pos, size_t *row, size_t *col){
+	*row = *col = 0;
+	ed_advance(editor.prompt, editor.prompt_len, row, col);
+	ed_advance(editor.buf, pos, row, col);
+}
+
+/**
+ * Bring the screen up to date and write the frame out. Appending at the end
+ * of the line, which is what typing and pasting do, only writes the new
+ * bytes; anything else repaints the prompt and the line from its first row.
+ * @param tail extra bytes for the same write, e.g. the final newline
+ */
+static void ed_refresh(const char *tail){
+	size_t plen = editor.prompt_len;
+	if(editor.redraw || editor.pos != editor.len || editor.drawn > editor.len){
+		if(editor.cursor_row > 0)
+			ed_emitf("\x1b[%zuA", editor.cursor_row);
+		ed_emit("\r\x1b[J", 4); // clear first: after the last column a clear would eat it
+		ed_emit(editor.prompt, plen);
+		ed_emit(editor.buf, editor.len);
+	} else {
+		ed_emit(editor.buf + editor.drawn, editor.len - editor.drawn);
+	}
+	size_t end_row, end_col, row, col;
+	ed_locate(editor.len, &end_row, &end_col);
+	if(end_col == 0 && editor.len > 0)
+		ed_emit("\r\n", 2); // out of the pending wrap state, so rows add up
+	ed_locate(editor.pos, &row, &col);
+	if(end_row > row)
+		ed_emitf("\x1b[%zuA", end_row - row);
+	if(row != end_row || editor.pos != editor.len){
+		ed_emit("\r", 1);
+		if(col > 0)
+			ed_emitf("\x1b[%zuC", col);
+	}
+	editor.cursor_row = row;
+	editor.drawn = editor.len;
+	editor.redraw = false;
+	if(tail != NULL)
+		ed_emit(tail, strlen(tail));
+	for(size_t done = 0; done < editor.out_len; ){
+		ssize_t r = write(STDOUT_FILENO, editor.out + done, editor.out_len - done);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) break;
+		done += r;
+	}
+	editor.out_len = 0;
+}
+
+static void ed_history(bool up){
+	size_t len;
+	if(up && editor.hist_age < hist_count()){
+		if(editor.hist_age == 0)
+			editor.stash = strdup(editor.buf);
+		const char *s = hist_get(++editor.hist_age, &len);
+		ed_set(s, len);
+	} else if(!up && editor.hist_age > 0){
+		if(--editor.hist_age == 0){
+			ed_set(editor.stash, strlen(editor.stash));
+			free(editor.stash);
+			editor.stash = NULL;
+		} else {
+			const char *s = hist_get(editor.hist_age, &len);
+			ed_set(s, len);
+		}
+	}
+}
+
+//Show the search state in place of the prompt, and the match as the line
+static void ed_search_show(){
+	size_t len;
+	int n = snprintf(editor.prompt, sizeof(editor.prompt), "(%sreverse-i-search)`%.*s': ",
+			editor.match_age || editor.query_len == 0 ? "" : "failed ",
+			(int)(editor.query_len < 1024 ? editor.query_len : 1024), editor.query);
+	editor.prompt_len = n;
+	if(editor.match_age > 0){
+		const char *s = hist_get(editor.match_age, &len);
+		ed_set(s, len);
+		const char *at = memmem(s, len, editor.query, editor.query_len);
+		editor.pos = at ? (size_t)(at - s) : 0;
+	}
+	editor.redraw = true;
+}
+
+//Search from an age; a failed search keeps the last match on screen
+static void ed_search(uint32_t from_age){
+	editor.match_age = editor.query_len ? hist_search(editor.query, editor.query_len, from_age) : 0;
+	ed_search_show();
+}
+
+static void ed_search_end(){
+	editor.searching = false;
+	editor.prompt_len = format_prompt(editor.prompt, sizeof(editor.prompt));
+	editor.hist_age = 0;
+	free(editor.stash);
+	editor.stash = NULL;
+	editor.redraw = true;
+}
+
+/**
+ * Keys while searching: text extends the query, Ctrl+R goes to an older
+ * match, Ctrl+G gives up and anything else takes the match and goes on
+ * as a normal key
+ * @param  c the byte
+ * @return   true if the key was used up by the search
+ */
+static bool ed_search_feed(unsigned char c){
+	if(c == 18){ // Ctrl+R
+		if(editor.query_len > 0)
+			ed_search(editor.match_age + 1);
+		return true;
+	}
+	if(c == 7){ // Ctrl+G
+		ed_set(editor.stash, strlen(editor.stash));
+		ed_search_end();
+		return true;
+	}
+	if(c == 127 || c == 8){
+		while(editor.query_len > 0 && ((unsigned char)editor.query[--editor.query_len] & 0xC0) == 0x80)
+			;
+		ed_search(1);
+		return true;
+	}
+	if(c >= 32){
+		if(editor.query_len + 1 > editor.query_cap){
+			editor.query_cap = editor.query_cap ? editor.query_cap * 2 : 64;
+			editor.query = realloc(editor.query, editor.query_cap);
+		}
+		editor.query[editor.query_len++] = c;
+		ed_search(editor.match_age ? editor.match_age : 1); // the current match may still do
+		return true;
+	}
+	ed_search_end();
+	return false;
+}
+
+//Insert completed text, escaping what the lexer would otherwise split on
+static void ed_insert_escaped(const char *s, size_t n, bool quoted){
+	for(size_t i = 0; i < n; i++){
+		if(!quoted && strchr(" \t|&<>\"'\\#$`;", s[i]) != NULL)
+			ed_insert("\\", 1);
+		ed_insert(s + i, 1);
+	}
+}
+
+//Print candidates in columns under the line; the prompt is redrawn below them
+static void ed_list(const char **matches, size_t count){
+	size_t width = 0, shown = count < 500 ? count : 500;
+	for(size_t i = 0; i < shown; i++)
+		if(strlen(matches[i]) > width)
+			width = strlen(matches[i]);
+	width += 2;
+	size_t per_row = editor.cols / width ? editor.cols / width : 1;
+	size_t rows = (shown + per_row - 1) / per_row;
+	size_t end_row, end_col;
+	ed_locate(editor.len, &end_row, &end_col);
+	if(end_row > editor.cursor_row)
+		ed_emitf("\x1b[%zuB", end_row - editor.cursor_row);
+	ed_emit("\r\n", 2);
+	for(size_t r = 0; r < rows; r++){ // column-major like ls
+		for(size_t c = 0; c < per_row && c * rows + r < shown; c++){
+			const char *m = matches[c * rows + r];
+			ed_emit(m, strlen(m));
+			if(c + 1 < per_row && (c + 1) * rows + r < shown)
+				for(size_t pad = strlen(m); pad < width; pad++)
+					ed_emit(" ", 1);
+		}
+		ed_emit("\r\n", 2);
+	}
+	if(shown < count)
+		ed_emitf("... and %zu more\r\n", count - shown);
+	editor.cursor_row = 0;
+	editor.redraw = true;
+}
+
+/**
+ * Tab: complete the word before the cursor. The first word of a pipeline
+ * stage is a command, anything after it a path. One candidate is inserted
+ * whole, several are completed to their common prefix, and a second Tab
+ * that can't add anything lists them
+ */
+static void ed_complete(){
+	size_t start = 0;
+	char quote = 0;
+	bool seen_word = false, after_redirect = false;
+	for(size_t i = 0; i < editor.pos; i++){ // split like the lexer does
+		char c = editor.buf[i];
+		if(quote){
+			if(c == quote) quote = 0;
+			continue;
+		}
+		if(c == '\\'){
+			i++;
+			continue;
+		}
+		if(c == '"' || c == '\''){
+			quote = c;
+			continue;
+		}
+		if(lex_blank(c) || c == '|' || c == '&' || c == '<' || c == '>'){
+			if(i > start){ // a word ended here
+				seen_word = seen_word || !after_redirect;
+				after_redirect = false;
+			}
+			bool to_file = c == '&' && i + 1 < editor.pos && editor.buf[i+1] == '>'; // &>
+			if((c == '|' || c == '&') && !to_file)
+				seen_word = false;
+			if(c == '<' || c == '>' || to_file)
+				after_redirect = true;
+			if(c == '>' && i + 2 < editor.pos && editor.buf[i+1] == '&' && editor.buf[i+2] == '1'){
+				after_redirect = false; // 2>&1 has no target
+				i += 2;
+			}
+			start = i + 1;
+		}
+	}
+	char *word = malloc(editor.pos - start + 1);
+	size_t len = 0;
+	char q = 0;
+	for(size_t i = start; i < editor.pos; i++){ // dequote what was typed so far
+		char c = editor.buf[i];
+		if(q ? c == q : (c == '"' || c == '\'')){
+			q = q ? 0 : c;
+			continue;
+		}
+		if(c == '\\' && !q && i + 1 < editor.pos)
+			c = editor.buf[++i];
+		word[len++] = c;
+	}
+	const char **matches;
+	bool command = !seen_word && !after_redirect;
+	size_t count = complete_word(word, len, command, &matches);
+	const char *slash = memrchr(word, '/', len);
+	size_t typed = slash ? word + len - slash - 1 : len;
+	free(word);
+	if(count == 0){
+		ed_emit("\a", 1);
+		return;
+	}
+	size_t common = strlen(matches[0]);
+	const char *last = matches[count - 1];
+	for(size_t i = 0; i < common; i++){
+		if(last[i] != matches[0][i]){
+			common = i;
+			break;
+		}
+	}
+	if(count == 1){
+		ed_insert_escaped(matches[0] + typed, common - typed, quote != 0);
+		if(matches[0][common - 1] != '/'){
+			if(quote)
+				ed_insert(&quote, 1);
+			ed_insert(" ", 1);
+		}
+	} else if(common > typed){
+		ed_insert_escaped(matches[0] + typed, common - typed, quote != 0);
+	} else if(editor.tabbed){
+		ed_list(matches, count);
+	} else {
+		ed_emit("\a", 1);
+		editor.tabbed = true;
+		return;
+	}
+	editor.tabbed = false;
+}
+
+//Cursor keys, shared by CSI and SS3 sequences
+static void ed_cursor_key(char c){
+	switch(c){
+	case 'A': ed_history(true); break;
+	case 'B': ed_history(false); break;
+	case 'C': ed_move(ed_next(editor.pos)); break;
+	case 'D': ed_move(ed_prev(editor.pos)); break;
+	case 'H': ed_move(0); break;
+	case 'F': ed_move(editor.len); break;
+	}
+}
+
+//A complete CSI sequence: parameters in editor.seq, then the final byte
+static void ed_csi(char final){
+	editor.seq[editor.seq_len] = '\0';
+	if(final != '~'){
+		ed_cursor_key(final);
+		return;
+	}
+	int n = atoi(editor.seq);
+	if(n == 200) editor.paste = true;
+	else if(n == 201) editor.paste = false;
+	else if(n == 1 || n == 7) ed_move(0);
+	else if(n == 4 || n == 8) ed_move(editor.len);
+	else if(n == 3 && editor.pos < editor.len) ed_delete(editor.pos, ed_next(editor.pos) - editor.pos);
+}
+
+/**
+ * Feed one byte of input to the editor
+ * @param  c the byte
+ * @return   what the prompt should do next
+ */
+static enum editor_result ed_feed(unsigned char c){
+	switch(editor.state){
+	case ED_ESC:
+		editor.state = c == '[' ? ED_CSI : c == 'O' ? ED_SS3 : ED_NORMAL;
+		editor.seq_len = 0;
+		return ED_MORE;
+	case ED_SS3:
+		editor.state = ED_NORMAL;
+		if(!editor.paste)
+			ed_cursor_key(c);
+		return ED_MORE;
+	case ED_CSI:
+		if(c >= 0x30 && c <= 0x3f){ // parameter bytes
+			if(editor.seq_len < (int)sizeof(editor.seq) - 1)
+				editor.seq[editor.seq_len++] = c;
+		} else if(c >= 0x40 && c <= 0x7e){ // final byte
+			editor.state = ED_NORMAL;
+			if(!editor.paste || c == '~')
+				ed_csi(c);
+		}
+		return ED_MORE;
+	case ED_NORMAL:
+		break;
+	}
+	if(c != 9)
+		editor.tabbed = false;
+	if(editor.searching && ed_search_feed(c))
+		return ED_MORE;
+	if(c == 27){
+		editor.state = ED_ESC;
+		return ED_MORE;
+	}
+	if(c == '\n' || c == '\r')
+		return ED_SUBMIT;
+	if(editor.paste){ // pasted tabs and control bytes are just text
+		char ch = c;
+		ed_insert(&ch, 1);
+		return ED_MORE;
+	}
+	switch(c){
+	case 9: // tab
+		ed_complete();
+		return ED_MORE;
+	case 127: case 8: // backspace
+		if(editor.pos > 0)
+			ed_delete(ed_prev(editor.pos), editor.pos - ed_prev(editor.pos));
+		break;
+	case 4: // Ctrl+D
+		if(editor.len == 0)
+			return ED_EOF;
+		if(editor.pos < editor.len)
+			ed_delete(editor.pos, ed_next(editor.pos) - editor.pos);
+		break;
+	case 1: ed_move(0); break; // Ctrl+A
+	case 5: ed_move(editor.len); break; // Ctrl+E
+	case 2: ed_cursor_key('D'); break; // Ctrl+B
+	case 6: ed_cursor_key('C'); break; // Ctrl+F
+	case 18: // Ctrl+R: reverse incremental search
+		editor.searching = true;
+		editor.query_len = 0;
+		editor.match_age = 0;
+		if(editor.stash == NULL)
+			editor.stash = strdup(editor.buf);
+		ed_search_show();
+		break;
+	case 16: ed_history(true); break; // Ctrl+P
+	case 14: ed_history(false); break; // Ctrl+N
+	case 11: // Ctrl+K: kill to the end
+		if(editor.pos < editor.len)
+			ed_delete(editor.pos, editor.len - editor.pos);
+		break;
+	case 21: // Ctrl+U: kill to the start
+		if(editor.pos > 0)
+			ed_delete(0, editor.pos);
+		break;
+	case 23: { // Ctrl+W: kill the word before the cursor
+		size_t from = editor.pos;
+		while(from > 0 && editor.buf[from-1] == ' ') from--;
+		while(from > 0 && editor.buf[from-1] != ' ') from--;
+		if(from < editor.pos)
+			ed_delete(from, editor.pos - from);
+		break;
+	}
+	case 12: // Ctrl+L: clear the screen
+		ed_emit("\x1b[H\x1b[2J", 7);
+		editor.cursor_row = 0;
+		editor.redraw = true;
+		break;
+	default:
+		if(c >= 32){
+			char ch = c;
+			ed_insert(&ch, 1);
+		}
+	}
+	return ED_MORE;
+}
+
+/**
+ * Feed a run of input, inserting plain text in one go
+ * @param  in  input bytes
+ * @param  n   how many
+ * @param  res set to the result of the last byte consumed
+ * @return     number of bytes consumed, stops after a submit or EOF
+ */
+static size_t ed_feed_all(const char *in, size_t n, enum editor_result *res){
+	size_t i = 0;
+	*res = ED_MORE;
+	while(i < n && *res == ED_MORE){
+		if(editor.state == ED_NORMAL && !editor.searching){
+			size_t run = i;
+			while(run < n && (unsigned char)in[run] >= 32 && (unsigned char)in[run] != 127)
+				run++;
+			if(run > i){
+				editor.tabbed = false;
+				ed_insert(in + i, run - i);
+				i = run;
+				continue;
+			}
+		}
+		*res = ed_feed(in[i++]);
+	}
+	return i;
+}
+
+/**
+ * Prompt for a line with the line editor and parse it into command
+ * @param  command [description]
+ * @return         SUCCESS, or EXIT on Ctrl+D or end of input
+ */
+int prompt(struct command_t *command)
+{
+	// tcgetattr gets the parameters of the current terminal
+	// STDIN_FILENO will tell tcgetattr that it should write the settings
+	// of stdin to oldt
+	static struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	// ICANON normally takes care that one line at a time will be processed
+	// that means it will return if it sees a "\n" or an EOF or an EOL
+	new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We redraw ourselves.
+	// Those new settings will be set to STDIN
+	// TCSANOW tells tcsetattr to change attributes immediately.
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	job_notify(); // background jobs that finished since the last prompt
+	hist_sync(); // pick up lines other shells added since the last prompt
+	struct winsize ws;
+	editor.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+	editor.prompt_len = format_prompt(editor.prompt, sizeof(editor.prompt));
+	editor.len = editor.pos = editor.drawn = editor.cursor_row = 0;
+	ed_reserve(0);
+	editor.buf[0] = '\0';
+	fflush(stdout);
+	ed_emit("\x1b[?2004h", 8); // bracketed paste on
+	editor.redraw = true;
+
+	enum editor_result res = ED_MORE;
+	while (res == ED_MORE)
+	{
+		if (editor.in_start == editor.in_len)
+		{
+			ed_refresh(NULL); // one frame per read
+			struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { job_event_fd(), POLLIN, 0 } };
+			if (poll(fds, fds[1].fd >= 0 ? 2 : 1, -1) > 0 && (fds[1].revents & POLLIN) && !(fds[0].revents & POLLIN))
+			{
+				job_reap(); // reap right away, the notice waits for the next prompt
+				continue;
+			}
+			ssize_t r = read(STDIN_FILENO, editor.in, sizeof(editor.in));
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0)
+			{
+				res = ED_EOF;
+				break;
+			}
+			editor.in_start = 0;
+			editor.in_len = r;
+		}
+		editor.in_start += ed_feed_all(editor.in + editor.in_start,
+				editor.in_len - editor.in_start, &res);
+	}
+	if (editor.searching)
+		ed_search_end();
+	editor.pos = editor.len;
+	ed_refresh("\x1b[?2004l\n"); // bracketed paste off, then leave the line
+
+	// restore the old settings
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	free(editor.stash);
+	editor.stash = NULL;
+	editor.hist_age = 0;
+	if (res == ED_EOF)
+		return EXIT;
+
+	hist_add(editor.buf, editor.len);
+	// the parsed strings point into the line, so it has to live as long as the command
+	parse_command(arena_strndup(&command_arena, editor.buf, editor.len), command);
+
+	// print_command(command); // DEBUG: uncomment for debugging
+	return SUCCESS;
+}
+int run_pipeline(struct command_t *command);
+char *path_lookup(const char *name);
+int hash_builtin(struct command_t *command, int in_fd, int out_fd);
+int spawn_command(struct command_t *command, const char *pathname, struct redirection *rd,
+		pid_t pgid, bool foreground, pid_t *pid);
+int set_builtin(struct command_t *command, int in_fd, int out_fd);
+int jobs_builtin(struct command_t *command, int in_fd, int out_fd);
+int fg_builtin(struct command_t *command, int in_fd, int out_fd);
+int bg_builtin(struct command_t *command, int in_fd, int out_fd);
+int wait_builtin(struct command_t *command, int in_fd, int out_fd);
+int kill_builtin(struct command_t *command, int in_fd, int out_fd);
+void job_control_init();
+int chatroom(struct command_t *command);
+void rps(struct command_t *command);
+void guessTheNumber(struct command_t *command);	
+int myuniq(struct command_t *command, int in_fd, int out_fd);
+int mysort(struct command_t *command, int in_fd, int out_fd);
+void wiseman(struct command_t *command);
+int io_redirect(struct command_t *command, int in_fd, int out_fd, struct redirection *rd);
+int process_command(struct command_t *command);
+int time_command(struct command_t *command);
+int run_line(const char *line, size_t len);
+int run_batch(int fd);
+int run_script_cached(const char *path);
+#ifndef SHELLAX_NO_MAIN
+int main(int argc, char *argv[])
+{
+	signal(SIGTTOU, SIG_IGN); // so we can take the terminal back from a pipeline
+	signal(SIGPIPE, SIG_IGN); // a builtin thread writing to a closed pipe gets EPIPE instead
+	setlocale(LC_CTYPE, ""); // so the line editor knows how wide UTF-8 text is
+
+	// batch mode: shellax -c "commands", shellax script, or commands on a pipe
+	if (argc==2 && strcmp(argv[1], "-c")==0)
+	{
+		printf("-%s: -c: option requires an argument\n", sysname);
+		return 2;
+	}
+	if (argc>2 && strcmp(argv[1], "-c")==0)
+	{
+		const char *p=argv[2], *nl;
+		while ((nl=strchr(p, '\n'))!=NULL && run_line(p, nl-p)!=EXIT)
+			p=nl+1;
+		if (nl==NULL)
+			run_line(p, strlen(p));
+		return last_status;
+	}
+	if (argc>2 && strcmp(argv[1], "--cache")==0)
+	{
+		run_script_cached(argv[2]);
+		return last_status;
+	}
+	if (argc>1)
+	{
+		int fd=open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (fd==-1)
+		{
+			printf("-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+			return 127;
+		}
+		run_batch(fd);
+		close(fd);
+		return last_status;
+	}
+	if (!isatty(STDIN_FILENO))
+	{
+		run_batch(STDIN_FILENO);
+		return last_status;
+	}
+
+	job_control_init();
+	while (1)
+	{
+		struct command_t *command=alloc_command();
+
+		int code;
+		code = prompt(command);
+		if (code==EXIT) break;
+
+		code = process_command(command);
+		if (code==EXIT) break;
+
+		free_command(command);
+	}
+
+	printf("\n");
+	return last_status;
+}
+#endif
+
+//HELPER METHODS
+void rps(struct command_t *command){
+	int n;
+	char pc; 
+	char pcStr[10];
+	char user[10];
+	char userStr[10];
+	srand(time(NULL)); //calculate random number btween 1-100
+	n = rand() % 100;
+	if(n < 33){ //choose r, p or s according to the number generated 
+		pc = 'r'; 
+		strcpy(pcStr, "ROCK");
+	} else if (n > 33 && n < 66){
+		pc = 'p';
+		strcpy(pcStr, "PAPER");
+	} else {
+		pc = 's';
+		strcpy(pcStr, "SCISSORS");
+	}
+
+	printf("\n\n\n\n\t\t\t\tEnter 'r' for Rock, 'p' for Paper, 's' for Scissors\n\t");	
+	
+	printf("Enter your choice: ");	//Take input from user r, p or s
+	fgets(user, sizeof(char)*10, stdin);
+
+	while(user[0] != 'r' && user[0] != 'p' && user[0] != 's'){
+		printf("\n\tU should enter r, p or s\n");
+		
+		printf("\tEnter your choice: ");	//Take input from user r, p or s
+		fgets(user, sizeof(char)*10, stdin);
+	}
+
+	if(user[0] == 'r'){
+		strcpy(userStr, "ROCK");
+	} else if (user[0] == 'p'){
+		strcpy(userStr, "PAPER");
+	} else {
+		strcpy(userStr, "SCISSORS");	
+	} 
+	//Game started prints
+	printf("\tYou choose: %s\n", userStr);	
+	sleep(1); //Sleep calls added to make the game feel realistic
+	printf("\t\t\t\t\tROCK!\n");
+	sleep(1);
+	printf("\t\t\t\t\t\tPAPER!\n");
+	sleep(1);
+	printf("\t\t\t\t\t\t\tSCISSORS!\n");
+	sleep(1);
+	printf("\t\t\t\t\t\tSHOOOT!\n");
+	sleep(0.5);
+	//printf("PC: %s\n", pcStr);	
+	printf("\t\t\t\t\t   --%s vs %s--\n", pcStr, userStr);	
+	
+	//End game prints
+	if(pc == user[0]){ 
+		printf("\n\t\t\t\t\t    Its a tie\n\n");
+	}
+	else if (pc == 'r'){
+		if(user[0] == 's'){
+			printf("\n\t\t\t\t\t    Computer WINS!\n\n");
 		} else if(user[0] == 'p'){
 			printf("\n\t\t\t\t\t    User WINS!\n\n");
 		}
@@ -478,362 +1535,4935 @@ void wiseman(struct command_t *command){
 	}
 }
 
-//MYUNIQ COMMAND IMPLEMENTATION
-int myuniq(struct command_t *command){
+//BUFFERED OUTPUT FOR BUILTINS: one write() per 64KB instead of stdio per line.
+//With fd -1 the output is collected in memory (mem) instead.
+#define OUT_BUF_SIZE 65536
 
-	char output[100][200]; //Our array we output
+struct out_buf {
+	int fd;
+	size_t len;
+	bool failed; // a write failed, e.g. the reader went away
+	char *mem;
+	size_t mem_len, mem_cap;
+	char data[OUT_BUF_SIZE];
+};
 
-	//variables
-	int i = 0; 
-	FILE *fptr;
-	char str[200];
+static struct out_buf *ob_open(int fd){
+	struct out_buf *ob = malloc(sizeof(struct out_buf));
+	ob->fd = fd;
+	ob->len = 0;
+	ob->failed = false;
+	ob->mem = NULL;
+	ob->mem_len = ob->mem_cap = 0;
+	return ob;
+}
 
-	if(strcmp(command->args[0], "-c") == 0 || strcmp(command->args[0], "--count") == 0){
-		fptr = fopen(command->args[1], "r"); //open file 
-	} else{
-		fptr = fopen(command->args[0], "r"); //open file 
+static void ob_raw_write(struct out_buf *ob, const char *s, size_t n){
+	if(ob->fd < 0){
+		if(ob->mem_len + n > ob->mem_cap){
+			ob->mem_cap = (ob->mem_len + n) * 2;
+			ob->mem = realloc(ob->mem, ob->mem_cap);
+		}
+		memcpy(ob->mem + ob->mem_len, s, n);
+		ob->mem_len += n;
+		return;
 	}
-
-	if(fptr == NULL){
-		printf("File cannot be found!\n");
-		return EXIT;	
+	while(n > 0 && !ob->failed){
+		ssize_t w = write(ob->fd, s, n);
+		if(w < 0){
+			if(errno != EINTR) ob->failed = true;
+			continue;
+		}
+		s += w;
+		n -= w;
 	}
+}
 
-	while(fgets(str,200,fptr) != NULL){ //Read from file
-		strcpy(output[i], str); //Output becomes lines in file
-		i++;
-	}
+static void ob_flush(struct out_buf *ob){
+	ob_raw_write(ob, ob->data, ob->len);
+	ob->len = 0;
+}
 
-	int counts[i];
-	int count = 1;
-	int y=0;
-	int t=0;
-	//Since the list should be sorted all the duplicates occur one after other
-	while(y < i) { //comparing output arrays elements to count the duplicates
-		if(strcmp(output[y], output[y+1]) == 0){ //if duplicate happens
-			count++; //increment current count
-			y++; //increment index 
-		} else {
-			counts[t] = count; //when duplicates end, meaning that count many same elements exits	
-			t++; //assign count to counts[t] and increment t
-			count=1; //restart count
-			y++; 
+static void ob_write(struct out_buf *ob, const char *s, size_t n){
+	if(n > OUT_BUF_SIZE - ob->len){
+		ob_flush(ob);
+		if(n >= OUT_BUF_SIZE){ //too big to be worth copying
+			ob_raw_write(ob, s, n);
+			return;
 		}
-	}	
-
-	int k, j, a;
-
-	//Iterate over output and delete duplicates
-	for(k = 0; k < i; k++){
-		for(j = k+1; j < i; j++){
-			if(k != j){
-				if(strcmp(output[j],output[k]) == 0){ 	//IF duplicate detected
-					//Iterating over array to reindex 
-					for(a = j; a < i; a++){
-						strcpy(output[a], output[a+1]);
-					}
-					k--; //decrement k
-					i--; //decrement size
-				}
-			}	
-		}			
 	}
-	//Display output
-	int x;
-	for(x = 0; x < i; x++){
-		if(strcmp(command->args[0],"-c") == 0 || strcmp(command->args[0], "--count") == 0){	
-			printf("\t%d ",counts[x]);
-		}
-		printf("%s",output[x]);
+	memcpy(ob->data + ob->len, s, n);
+	ob->len += n;
+}
 
-	}	
+static void ob_putc(struct out_buf *ob, char c){
+	if(ob->len == OUT_BUF_SIZE)
+		ob_flush(ob);
+	ob->data[ob->len++] = c;
+}
 
-	return SUCCESS;
+static void ob_number(struct out_buf *ob, unsigned long n){
+	char tmp[24];
+	int i = sizeof(tmp);
+	do {
+		tmp[--i] = '0' + n % 10;
+		n /= 10;
+	} while(n);
+	ob_write(ob, tmp + i, sizeof(tmp) - i);
 }
-//IO REDIRECTION
-int io_redirect(struct command_t *command){
 
-	int fileNo;
-	FILE *fptr;
-	//IO REDIRECTION PART
-	if(command->redirects[0] != NULL){ //IO REDIRECTION OP 1 "<"
-		fptr = fopen(command->redirects[0], "r"); //open a file with the parsed name for reading
-		if(fptr == NULL) { //null check
-			printf("File not found\n"); 
-			return EXIT;
-		}
-		char line[100]; //string to read from the file
-		fileNo = fileno(fptr);	//taking int fileno to be able to dup2()
-		if(dup2(fileNo, STDIN_FILENO) < 0){ //null check
-			return EXIT;
+//returns -1 if any write failed
+static int ob_close(struct out_buf *ob){
+	ob_flush(ob);
+	int r = ob->failed ? -1 : 0;
+	free(ob->mem);
+	free(ob);
+	return r;
+}
+
+//LINE READER: yields lines as (ptr, len) without the newline. Regular files
+//are mmapped and scanned in place; pipes go through a large read() buffer
+//whose memory is bounded by the longest line.
+#define LINE_READER_CHUNK (1 << 20)
+
+struct line_reader {
+	int fd;
+	char *buf;
+	size_t cap, start, end;
+	bool eof;
+	bool mapped; // buf is an mmap of the whole file
+	bool stable; // returned lines stay valid until lr_free, not just the next call
+};
+
+static const char *scan_newline_scalar(const char *p, const char *end){
+	return memchr(p, '\n', end - p);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static const char *scan_newline_sse2(const char *p, const char *end){
+	const __m128i nl = _mm_set1_epi8('\n');
+	for(; end - p >= 16; p += 16){
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+		if(mask)
+			return p + __builtin_ctz(mask);
+	}
+	return scan_newline_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_newline_avx2(const char *p, const char *end){
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for(; end - p >= 64; p += 64){ //two vectors per iteration, one branch
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)p), nl);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 32)), nl);
+		if(!_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))){
+			unsigned ma = _mm256_movemask_epi8(a);
+			if(ma)
+				return p + __builtin_ctz(ma);
+			return p + 32 + __builtin_ctz((unsigned)_mm256_movemask_epi8(b));
 		}
-		while(fgets(line, 100, fptr) != NULL){	//read lines and print them
-			printf("%s", line);	
+	}
+	return scan_newline_sse2(p, end);
+}
+#endif
+
+static const char *(*scan_newline)(const char *p, const char *end);
+
+//Pick the widest newline scanner the CPU supports, once
+static void lr_pick_scanner(void){
+	if(scan_newline) return;
+	scan_newline = scan_newline_scalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+	scan_newline = scan_newline_sse2; //baseline on x86-64
+	if(__builtin_cpu_supports("avx2"))
+		scan_newline = scan_newline_avx2;
+#endif
+}
+
+static void lr_init(struct line_reader *lr, int fd){
+	struct stat st;
+	lr_pick_scanner();
+	lr->fd = fd;
+	lr->start = lr->end = 0;
+	lr->eof = lr->mapped = lr->stable = false;
+
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && pos >= 0 && st.st_size > pos){
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map != MAP_FAILED){
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			lr->buf = map;
+			lr->cap = lr->end = st.st_size;
+			lr->start = pos; //respect what was already consumed from a shared fd
+			lr->eof = lr->mapped = lr->stable = true;
+			return;
 		}
 	}
-	else if(command->redirects[1] != NULL) { //IO REDIRECTION OP 2 ">"
-		fptr = fopen(command->redirects[1], "w"); //Open a file for writing
-		fileNo = fileno(fptr);
+	lr->cap = LINE_READER_CHUNK;
+	lr->buf = malloc(lr->cap);
+}
+
+static void lr_free(struct line_reader *lr){
+	if(lr->mapped){
+		lseek(lr->fd, lr->start, SEEK_SET); //leave a shared fd where we stopped
+		munmap(lr->buf, lr->cap);
+	} else {
+		free(lr->buf);
+	}
+	lr->buf = NULL;
+}
 
-		if(dup2(fileNo, STDOUT_FILENO) < 0){ //null check
-			return EXIT;
+/**
+ * Next line of input. The returned pointer stays valid until the next
+ * call, or until lr_free when lr->stable is set.
+ * @param  lr   reader
+ * @param  line set to the start of the line
+ * @return      length of the line, -1 at end of input or on error
+ */
+static ssize_t lr_next(struct line_reader *lr, const char **line){
+	size_t scanned = lr->start;
+	while(1){
+		const char *nl = scan_newline(lr->buf + scanned, lr->buf + lr->end);
+		if(nl != NULL){
+			*line = lr->buf + lr->start;
+			ssize_t len = nl - *line;
+			lr->start = nl - lr->buf + 1;
+			return len;
+		}
+		if(lr->eof){
+			if(lr->start == lr->end) return -1;
+			*line = lr->buf + lr->start; //last line without a newline
+			ssize_t len = lr->end - lr->start;
+			lr->start = lr->end;
+			return len;
 		}
+		//move the partial line to the front, grow only if it fills the buffer
+		size_t partial = lr->end - lr->start;
+		memmove(lr->buf, lr->buf + lr->start, partial);
+		lr->start = 0;
+		lr->end = scanned = partial;
+		if(lr->end == lr->cap){
+			lr->cap *= 2;
+			lr->buf = realloc(lr->buf, lr->cap);
+		}
+		ssize_t r = read(lr->fd, lr->buf + lr->end, lr->cap - lr->end);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) lr->eof = true;
+		else lr->end += r;
 	}
-	else if (command->redirects[2] != NULL){ //IO REDIRECTION OP 3 ">>"
-		fptr = fopen(command->redirects[2], "a"); //Open a file for appending
-		fileNo = fileno(fptr);
+}
 
-		if(dup2(fileNo, STDOUT_FILENO) < 0){ //null check
-			return EXIT;
+//BATCH MODE: scripts, -c and piped input run without a prompt or termios
+/**
+ * Parse and run one line of input outside the interactive prompt
+ * @param  line the line, not NUL terminated
+ * @param  len  its length
+ * @return      EXIT if the line ran exit, SUCCESS otherwise
+ */
+int run_line(const char *line, size_t len){
+	job_notify(); // background jobs of the script, before they pile up as zombies
+	struct command_t *command = alloc_command();
+	// the parsed strings point into the line, so it has to live as long as the command
+	parse_command(arena_strndup(&command_arena, line, len), command);
+	int code = process_command(command);
+	free_command(command);
+	return code;
+}
+
+/**
+ * Run every line read from fd, stopping at exit. Input is read with the
+ * line reader, so a script file is mmapped and a pipe is read a megabyte at
+ * a time. Commands can only share a seekable stdin with the script: the
+ * offset is moved to the next line before each command and whatever the
+ * command consumed is skipped afterwards, so a pipe's read-ahead is never
+ * seen by them.
+ * @param  fd script
+ * @return    EXIT if the script ran exit, SUCCESS at end of input
+ */
+int run_batch(int fd){
+	struct line_reader lr;
+	const char *line;
+	ssize_t len;
+	int code = SUCCESS;
+	lr_init(&lr, fd);
+	bool shared = lr.mapped && fd == STDIN_FILENO;
+	while(code != EXIT && (len = lr_next(&lr, &line)) >= 0){
+		if(shared)
+			lseek(fd, lr.start, SEEK_SET);
+		code = run_line(line, len);
+		if(shared){
+			off_t pos = lseek(fd, 0, SEEK_CUR);
+			if(pos > (off_t)lr.start && pos <= (off_t)lr.end)
+				lr.start = pos;
 		}
-	}		
-	close(fileNo); //close the files after finishing 
+	}
+	lr_free(&lr);
+	return code;
 }
 
+//HISTORY: one command per line in an append-only file shared by every running
+//shell. The newest HISTORY_SIZE entries are kept in a ring of (ptr, len) into
+//the history arena: lines are copied out of the file as they are read, so
+//truncating it under a running shell can't fault, and the arena is repacked
+//once evicted lines make up most of it. Appends go through O_APPEND under an
+//exclusive flock.
+#define HISTORY_SIZE (1 << 17)
+#define HISTORY_COMPACT_BYTES (32 << 20) // rewritten down to the ring at startup past this
+#define HISTORY_BUCKETS (1 << 16) // trigram posting lists for Ctrl+R
+#define HISTORY_REPACK_BYTES (8 << 20) // an arena past this and twice the ring's text is copied down
 
-//PIPING COMMANDS
-int pipe_command(struct command_t *command, char *pathname, int *fd){
-	//printf("Hello from temp command %s\n", temp_command->name);
-	//printf("rdir0 %s, rdir1 %s\n", command->redirects[0],  command->redirects[1]);		
-	struct command_t *nextCommand = command->next;
+struct hist_entry {
+	const char *s;
+	uint32_t len;
+};
 
-	//PIPE PART
-	if(pipe(fd) == -1){
-		return EXIT;
+//Sequence numbers of the entries containing a trigram, increasing. Trigrams
+//share buckets, so a hit is only a candidate. Entries that leave the ring
+//are dropped from the front by moving start
+struct hist_posting {
+	uint32_t *seq;
+	uint32_t start, len, cap;
+};
+
+static struct {
+	bool opened;
+	char path[PATH_MAX];
+	int fd; // -1 when there is no usable file, history is then per session
+	ino_t ino; // inode fd refers to, a compaction by another shell replaces it
+	off_t read_len; // bytes of the file already in the ring
+	struct hist_entry *ring; // entry number s lives in ring[s % HISTORY_SIZE]
+	uint32_t next_seq;
+	size_t live; // bytes of text in the ring, the rest of the arena is evicted entries
+	struct arena arena;
+	struct hist_posting *index; // built by the first search, then kept up to date
+} history = { .fd = -1 };
+
+uint32_t hist_count(){
+	return history.next_seq < HISTORY_SIZE ? history.next_seq : HISTORY_SIZE;
+}
+
+/**
+ * An entry by age
+ * @param  age 1 for the newest, up to hist_count()
+ * @param  len set to its length
+ * @return     its text, not NUL terminated
+ */
+const char *hist_get(uint32_t age, size_t *len){
+	struct hist_entry *e = &history.ring[(history.next_seq - age) % HISTORY_SIZE];
+	*len = e->len;
+	return e->s;
+}
+
+static uint32_t hist_trigram(const char *p){
+	uint32_t t = (unsigned char)p[0] | (unsigned char)p[1] << 8 | (unsigned char)p[2] << 16;
+	return (t * 2654435761u) >> 16;
+}
+
+static void hist_index_entry(uint32_t seq){
+	struct hist_entry *e = &history.ring[seq % HISTORY_SIZE];
+	for(uint32_t i = 0; i + 3 <= e->len; i++){
+		struct hist_posting *p = &history.index[hist_trigram(e->s + i)];
+		if(p->len > 0 && p->seq[p->len-1] == seq)
+			continue;
+		if(p->len == p->cap && p->start > 0){ // reuse what eviction freed
+			memmove(p->seq, p->seq + p->start, (p->len - p->start) * sizeof(uint32_t));
+			p->len -= p->start;
+			p->start = 0;
+		}
+		if(p->len == p->cap){
+			p->cap = p->cap ? p->cap * 2 : 8;
+			p->seq = realloc(p->seq, p->cap * sizeof(uint32_t));
+		}
+		p->seq[p->len++] = seq;
 	}
-	strcpy(pathname, "/usr/bin/");
-	pid_t pid2 = fork(); //fork child to be executed
+}
 
-	if(pid2 == -1){ //fork fail check
-		printf("Fork error\n");
-		return EXIT;
+//Drop an entry that is leaving the ring from the postings; it is the oldest
+//one, so it can only be at the front of each list
+static void hist_unindex_entry(uint32_t seq){
+	struct hist_entry *e = &history.ring[seq % HISTORY_SIZE];
+	for(uint32_t i = 0; i + 3 <= e->len; i++){
+		struct hist_posting *p = &history.index[hist_trigram(e->s + i)];
+		if(p->start < p->len && p->seq[p->start] == seq)
+			p->start++;
+		if(p->start == p->len)
+			p->start = p->len = 0;
 	}
+}
 
-	else if(pid2 == 0){ //child process 	
-		dup2(fd[1], 1); //Writing end of pipe takes input from STDOUT
-	} else {
-		close(fd[1]);	//Close writing end
-		dup2(fd[0],0); //Reading end takes input from STDIN
-		close(fd[0]); //Close reading end
-		strcat(pathname, nextCommand->name); //Concat pathname with command->name
+static void hist_push(const char *s, size_t len){
+	if(history.next_seq >= HISTORY_SIZE){
+		if(history.index != NULL)
+			hist_unindex_entry(history.next_seq - HISTORY_SIZE);
+		history.live -= history.ring[history.next_seq % HISTORY_SIZE].len;
+	}
+	history.live += len;
+	history.ring[history.next_seq % HISTORY_SIZE] = (struct hist_entry){ s, len };
+	if(history.index != NULL)
+		hist_index_entry(history.next_seq);
+	history.next_seq++;
+}
 
-		int i = 0;
-		char *temp;
+//Push every complete line, returns the bytes consumed
+static size_t hist_push_lines(const char *p, size_t len){
+	const char *end = p + len, *start = p, *nl;
+	while(start < end && (nl = memchr(start, '\n', end - start)) != NULL){
+		if(nl > start)
+			hist_push(start, nl - start);
+		start = nl + 1;
+	}
+	return start - p;
+}
+
+static bool hist_same_file(){
+	struct stat st;
+	return stat(history.path, &st) == 0 && st.st_ino == history.ino;
+}
+
+static void hist_reopen(){
+	struct stat st;
+	if(history.fd != -1)
+		close(history.fd);
+	history.fd = open(history.path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if(history.fd != -1 && fstat(history.fd, &st) == 0)
+		history.ino = st.st_ino;
+}
+
+//Evicted entries stay in the arena: once they are most of it, copy what
+//the ring still holds into a fresh one and drop the old
+static void hist_repack(){
+	if(history.arena.total < HISTORY_REPACK_BYTES || history.arena.total < 2 * history.live)
+		return;
+	struct arena fresh = { 0 };
+	char *p = arena_alloc(&fresh, history.live);
+	for(uint32_t seq = history.next_seq - hist_count(); seq != history.next_seq; seq++){
+		struct hist_entry *e = &history.ring[seq % HISTORY_SIZE];
+		memcpy(p, e->s, e->len);
+		e->s = p;
+		p += e->len;
+	}
+	arena_free(&history.arena);
+	history.arena = fresh;
+}
+
+//Replace the file with just the entries in the ring, under the exclusive lock
+static void hist_compact(){
+	char tmp[PATH_MAX + 8];
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", history.path);
+	int fd = mkstemp(tmp);
+	if(fd == -1)
+		return;
+	struct out_buf *ob = ob_open(fd);
+	for(uint32_t age = hist_count(); age > 0; age--){
+		size_t len;
+		const char *s = hist_get(age, &len);
+		ob_write(ob, s, len);
+		ob_putc(ob, '\n');
+	}
+	bool ok = ob_close(ob) == 0;
+	close(fd);
+	if(!ok || rename(tmp, history.path) == -1)
+		unlink(tmp);
+}
 
-		while(i < nextCommand->arg_count){ //Indentication of command->args
-			temp = nextCommand->args[i];
-			if(i == 0){
-				nextCommand->args[i] = nextCommand->name;
+//Read the newest HISTORY_SIZE lines of the file into the ring
+static void hist_load(){
+	struct stat st;
+	history.read_len = 0;
+	flock(history.fd, LOCK_SH);
+	if(fstat(history.fd, &st) == 0 && st.st_size > 0){
+		char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+		if(map != MAP_FAILED){
+			//only the newest HISTORY_SIZE lines go in the ring, find where they start
+			const char *end = map + st.st_size, *start, *nl;
+			while(end > map && end[-1] != '\n') end--; // a line still being written
+			start = end;
+			for(uint32_t lines = 0; start > map && lines < HISTORY_SIZE; lines++){
+				nl = memrchr(map, '\n', start - 1 - map);
+				start = nl ? nl + 1 : map;
 			}
-			nextCommand->args[i+1] = temp;
-			i++;
+			char *copy = arena_alloc(&history.arena, end - start);
+			memcpy(copy, start, end - start);
+			history.read_len = (start - map) + hist_push_lines(copy, end - start);
+			munmap(map, st.st_size);
 		}
-		execv(pathname, nextCommand->args); //Call piped command
-		return SUCCESS;
 	}
-	if(nextCommand->next != NULL){
-		int newfd[2];
-		pipe_command(nextCommand, pathname, newfd);
+	flock(history.fd, LOCK_UN);
+}
+
+//Empty the ring and the search index, to load the file again
+static void hist_forget(){
+	if(history.index != NULL){
+		for(uint32_t i = 0; i < HISTORY_BUCKETS; i++)
+			free(history.index[i].seq);
+		free(history.index);
+		history.index = NULL;
+	}
+	history.next_seq = 0;
+	history.live = 0;
+	arena_reset(&history.arena);
+}
+
+static void hist_open(){
+	struct stat st;
+	history.opened = true;
+	history.ring = malloc(sizeof(struct hist_entry) * HISTORY_SIZE);
+	const char *file = getenv("HISTFILE"), *home = getenv("HOME");
+	if(file != NULL && *file != '\0')
+		snprintf(history.path, sizeof(history.path), "%s", file);
+	else if(home != NULL)
+		snprintf(history.path, sizeof(history.path), "%s/.%s_history", home, sysname);
+	else
+		return;
+	hist_reopen();
+	if(history.fd == -1)
+		return;
+	hist_load();
+	if(history.read_len > HISTORY_COMPACT_BYTES){
+		flock(history.fd, LOCK_EX);
+		hist_compact();
+		flock(history.fd, LOCK_UN);
+		hist_reopen();
+		if(fstat(history.fd, &st) == 0)
+			history.read_len = st.st_size;
 	}
+}
 
+/**
+ * Bring the ring up to date with lines other shells (and this one) appended
+ * since the last call. Opens and reads the file the first time, and again
+ * from the start when it was compacted or truncated since.
+ */
+void hist_sync(){
+	struct stat st;
+	if(!history.opened){
+		hist_open();
+		return;
+	}
+	if(history.fd == -1)
+		return;
+	bool replaced = !hist_same_file(); // compacted by another shell
+	if(replaced)
+		hist_reopen();
+	if(history.fd == -1 || fstat(history.fd, &st) == -1)
+		return;
+	if(replaced || st.st_size < history.read_len){
+		hist_forget();
+		hist_load();
+		return;
+	}
+	if(st.st_size == history.read_len)
+		return;
+	size_t len = st.st_size - history.read_len;
+	char *buf = arena_alloc(&history.arena, len);
+	ssize_t r = pread(history.fd, buf, len, history.read_len);
+	if(r > 0)
+		history.read_len += hist_push_lines(buf, r);
+	hist_repack();
 }
-int chatroom(struct command_t *command){
 
-	printf("Welcome to %s %s\n", command->args[0], command->args[1]);
-	char filename[200];
-	struct stat stats;
-	
-	//Editing the name of the folder to be created
-	strcpy(filename, "/tmp/");
-	strcat(filename, "chatroom-");
-	strcat(filename, command->args[0]);
-	char *room = strdup(filename); //setting it to a new str named room
-
-	if(stat(room, &stats) == -1){ //If it doesn't exist 	
-		mkdir(room, 0700); //create a new directory
-	}
-
-	strcat(filename, "/"); //Continue editing to be able to add pipes  
-	strcat(filename, command->args[1]); //append the user name to the str
-	char *user = strdup(filename); //set it to a new str named user
-
-	if(access(user, F_OK) != 0){ //If it doesn't exist
-		mkfifo(user, 0666); //Create a new named pipe
-	}
-
-	//Inputs that will be needed while reading stdin
-	char *inputStr = malloc(sizeof(char)* 256); //Input str
-	size_t len = 256; //size of read
-	ssize_t	lineSize = 0; //return value;
-
-	pid_t pid1, pid2;
-	pid1 = fork();	
-	if(pid1 == 0) { 
-		while(true) { //Continiously read from stdin
-			lineSize = getline(&inputStr, &len, stdin);
-			if(lineSize > 1){ //When pressed enter and size > 1
-				struct dirent *dir; 
-				DIR *dptr;
-				dptr = opendir(room); //Open directory	 
-				if(dptr){ //If ptr is not null
-					while((dir = readdir(dptr)) != NULL){ //Start iterating over files in folder
-						pid2 = fork(); //Fork one more time to be able to synchronously write to pipes
-						if(pid2 == 0) {
-							if(strcmp(".", dir->d_name) == 0 || strcmp("..",dir->d_name) == 0){ //Default subfolders 
-								exit(0);
-							
-							} else if(strcmp(command->args[1], dir->d_name) == 0) { //The user that called the method 
-								exit(0);
-							
-							} else {
-								char *temp = malloc(sizeof(char)*256); //Temp str to hold current user
-								//Appopriate appendings to the username
-								strcat(temp, room); 
-								strcat(temp,"/");
-								strcat(temp, dir->d_name);
-									
-								char *msg = malloc(sizeof(char)*512); //The message that will be written to the pipe
-								
-								//Appopriate appendings to the msg
-								strcat(msg, "["); 
-								strcat(msg, command->args[0]);
-								strcat(msg, "] ");
-								strcat(msg, command->args[1]);
-								strcat(msg, ": ");
-								strcat(msg, inputStr); //Append inputStr to the message at the end
-
-
-								int fd1 = open(temp, O_WRONLY); //Open the pipe 
-								write(fd1, msg, strlen(msg)*sizeof(char)); //Write into it
-								close(fd1); //Close the pipe
-								//printf("[%s] %s: %s", command->args[0], command->args[1],inputStr);
-
-								fflush(stdout); //fflush to clear the output buffer
-								free(msg); //free allocated msg
-								free(temp); //free the allocated user str
-								exit(0);
-							}
-						}
-					}
-				}
-				closedir(dptr); //closing directory	
-			}
-			free(inputStr); //free allocated input str
-			inputStr = malloc(sizeof(char)*256); //reallocate
+/**
+ * Record a line. It goes to the file and comes back into the ring with the
+ * next hist_sync, so every shell sees the same order
+ * @param line the line
+ * @param len  its length
+ */
+void hist_add(const char *line, size_t len){
+	size_t last_len;
+	if(len == 0 || memchr(line, '\n', len) != NULL)
+		return;
+	if(hist_count() > 0){
+		const char *last = hist_get(1, &last_len);
+		if(last_len == len && memcmp(last, line, len) == 0)
+			return; // no consecutive duplicates
+	}
+	if(history.fd != -1){
+		char *buf = malloc(len + 1);
+		memcpy(buf, line, len);
+		buf[len] = '\n';
+		flock(history.fd, LOCK_EX);
+		if(!hist_same_file())
+			hist_reopen();
+		ssize_t r = history.fd == -1 ? -1 : write(history.fd, buf, len + 1);
+		if(history.fd != -1)
+			flock(history.fd, LOCK_UN);
+		free(buf);
+		if(r == (ssize_t)len + 1)
+			return;
+	}
+	char *copy = arena_alloc(&history.arena, len);
+	memcpy(copy, line, len);
+	hist_push(copy, len);
+	hist_repack();
+}
+
+/**
+ * Newest entry containing a string, starting at a given age
+ * @param  query    text to look for
+ * @param  qlen     its length
+ * @param  from_age first age to consider, 1 for the newest entry
+ * @return          age of the match, 0 if there is none
+ */
+uint32_t hist_search(const char *query, size_t qlen, uint32_t from_age){
+	uint32_t count = hist_count(), oldest = history.next_seq - count;
+	if(from_age == 0 || from_age > count)
+		return 0;
+	uint32_t top = history.next_seq - from_age; // newest sequence number to try
+	if(qlen < 3){ // no trigram to go by, these are cheap to scan for anyway
+		for(uint32_t age = from_age; age <= count; age++){
+			size_t len;
+			const char *s = hist_get(age, &len);
+			if(memmem(s, len, query, qlen) != NULL)
+				return age;
 		}
-	} else 
-	{
-		char *str; 
-		while(true){ //Continiously
-			str = (char *)malloc(sizeof(char)*256); //Malloc str
-			int fd0 = open(user,O_RDWR); //open pipe
-			read(fd0,str,128); //read from it 
+		return 0;
+	}
+	if(history.index == NULL){
+		history.index = calloc(HISTORY_BUCKETS, sizeof(struct hist_posting));
+		for(uint32_t seq = oldest; seq != history.next_seq; seq++)
+			hist_index_entry(seq);
+	}
+	//walk the shortest posting list of the query's trigrams, newest first
+	struct hist_posting *best = NULL;
+	for(size_t i = 0; i + 3 <= qlen; i++){
+		struct hist_posting *p = &history.index[hist_trigram(query + i)];
+		if(best == NULL || p->len - p->start < best->len - best->start)
+			best = p;
+	}
+	uint32_t lo = best->start, hi = best->len; // first position past top
+	while(lo < hi){
+		uint32_t mid = (lo + hi) / 2;
+		if(best->seq[mid] <= top) lo = mid + 1;
+		else hi = mid;
+	}
+	while(lo > best->start && best->seq[lo-1] >= oldest){
+		uint32_t seq = best->seq[--lo];
+		struct hist_entry *e = &history.ring[seq % HISTORY_SIZE];
+		if(memmem(e->s, e->len, query, qlen) != NULL)
+			return history.next_seq - seq;
+	}
+	return 0;
+}
 
-			close(fd0); //close pipe
-		
-			printf("%s", str); //print the read message
-			fflush(stdout); //clear buffer 
-			free(str); //free allocated memory
+//MYUNIQ COMMAND IMPLEMENTATION
+#define UNIQ_COUNT 1 // -c: prefix lines with their run length
+#define UNIQ_REPEATED 2 // -d: only print lines that repeat
+#define UNIQ_UNIQUE 4 // -u: only print lines that don't repeat
+#define UNIQ_IGNORE_CASE 8 // -i
+#define UNIQ_GLOBAL 16 // --global: input doesn't have to be sorted
+#define UNIQ_SORT_BY_COUNT 32 // --sort-by-count: most frequent first
+
+static bool uniq_equal(const char *a, size_t alen, const char *b, size_t blen, int flags){
+	if(alen != blen) return false;
+	if(!(flags & UNIQ_IGNORE_CASE)) return memcmp(a, b, alen) == 0;
+	for(size_t i = 0; i < alen; i++) // by length, lines may hold NUL bytes
+		if(tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+	return true;
+}
+
+static void uniq_emit(struct out_buf *ob, const char *line, size_t len, unsigned long count, int flags){
+	if((flags & UNIQ_REPEATED) && count < 2) return;
+	if((flags & UNIQ_UNIQUE) && count > 1) return;
+	if(flags & UNIQ_COUNT){
+		ob_putc(ob, '\t');
+		ob_number(ob, count);
+		ob_putc(ob, ' ');
+	}
+	ob_write(ob, line, len);
+	ob_putc(ob, '\n');
+}
+
+//MYUNIQ --global: dedup of unsorted input with a hash table keyed into an arena
+#define UNIQ_PARTITIONS 16
+#define UNIQ_MAX_LEVEL 4 // repartition at most this deep, then ignore the cap
+#define UNIQ_DEFAULT_MAX_MEMORY ((size_t)512 << 20)
+
+struct uniq_entry {
+	uint64_t hash;
+	const char *key; // in the arena
+	size_t len;
+	uint64_t count;
+	uint64_t first; // input line number of the first occurrence
+};
+
+struct uniq_table {
+	struct arena keys;
+	struct uniq_entry *entries; // in first-seen order
+	size_t count, cap;
+	uint32_t *slots; // entry index + 1, 0 for empty, linear probing
+	size_t slot_mask;
+};
+
+struct uniq_ctx {
+	struct uniq_table table;
+	int flags;
+	size_t max_memory;
+	const char *tmpdir;
+};
+
+//Where ordered results go: the final output or a record file for merging
+struct uniq_sink {
+	FILE *records;
+	struct out_buf *ob;
+	int flags;
+};
+
+//Input of one pass: lines of the original input or spilled records
+struct uniq_source {
+	struct line_reader *lr;
+	FILE *records;
+	uint64_t seq;
+	char *buf;
+	size_t cap;
+};
+
+static uint64_t uniq_hash(const char *s, size_t len, int flags, uint64_t seed){
+	uint64_t h = 14695981039346656037ULL ^ seed; //FNV-1a
+	if(flags & UNIQ_IGNORE_CASE){
+		for(size_t i = 0; i < len; i++){
+			h ^= (unsigned char)tolower((unsigned char)s[i]);
+			h *= 1099511628211ULL;
+		}
+	} else {
+		for(size_t i = 0; i < len; i++){
+			h ^= (unsigned char)s[i];
+			h *= 1099511628211ULL;
 		}
 	}
-	return SUCCESS;
+	return h ^ (h >> 29);
 }
 
-int process_command(struct command_t *command)
-{
-	char pathname[100] = "/usr/bin/";
-	int r;
-	if (strcmp(command->name, "")==0) return SUCCESS;
+//Level specific seed so a partition that spills again splits differently
+static uint64_t uniq_seed(int level){
+	return (uint64_t)level * 0x9E3779B97F4A7C15ULL;
+}
 
-	if (strcmp(command->name, "exit")==0)
-		return EXIT;
+static size_t ut_memory(struct uniq_table *t){
+	return t->keys.total + t->cap * sizeof(struct uniq_entry) + (t->slot_mask + 1) * sizeof(uint32_t);
+}
 
-	if (strcmp(command->name, "cd")==0)
-	{
-		if (command->arg_count > 0)
-		{
-			r=chdir(command->args[0]);
-			if (r==-1)
-				printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-			return SUCCESS;
+static void ut_reset(struct uniq_table *t){
+	arena_reset(&t->keys);
+	t->count = 0;
+	if(t->slots)
+		memset(t->slots, 0, (t->slot_mask + 1) * sizeof(uint32_t));
+}
+
+static void ut_free(struct uniq_table *t){
+	arena_free(&t->keys);
+	free(t->entries);
+	free(t->slots);
+}
+
+static void ut_grow(struct uniq_table *t){
+	size_t slots = t->slots ? (t->slot_mask + 1) * 2 : 1024;
+	free(t->slots);
+	t->slots = calloc(slots, sizeof(uint32_t));
+	t->slot_mask = slots - 1;
+	for(size_t i = 0; i < t->count; i++){
+		size_t s = t->entries[i].hash & t->slot_mask;
+		while(t->slots[s])
+			s = (s + 1) & t->slot_mask;
+		t->slots[s] = i + 1;
+	}
+}
+
+/**
+ * Count one more occurrence of key, adding it on first sight
+ * @param  t     table
+ * @param  hash  uniq_hash of the key
+ * @param  key   line, copied into the arena when new
+ * @param  len   length of the line
+ * @param  first line number of this occurrence
+ * @param  count occurrences it stands for
+ * @param  flags UNIQ_* flags
+ */
+static void ut_add(struct uniq_table *t, uint64_t hash, const char *key, size_t len,
+		uint64_t first, uint64_t count, int flags){
+	if(t->slots == NULL || (t->count + 1) * 10 > (t->slot_mask + 1) * 7) //keep load under 0.7
+		ut_grow(t);
+	size_t s = hash & t->slot_mask;
+	while(t->slots[s]){
+		struct uniq_entry *e = &t->entries[t->slots[s] - 1];
+		if(e->hash == hash && uniq_equal(e->key, e->len, key, len, flags)){
+			e->count += count;
+			if(first < e->first)
+				e->first = first;
+			return;
 		}
+		s = (s + 1) & t->slot_mask;
 	}
-	if(strcmp(command->name, "uniq") == 0){
-		myuniq(command);
-		return SUCCESS;
+	if(t->count == t->cap){
+		t->cap = t->cap ? t->cap * 2 : 1024;
+		t->entries = realloc(t->entries, t->cap * sizeof(struct uniq_entry));
 	}
+	char *copy = arena_alloc(&t->keys, len ? len : 1);
+	memcpy(copy, key, len);
+	t->entries[t->count] = (struct uniq_entry){ hash, copy, len, count, first };
+	t->slots[s] = ++t->count;
+}
 
+static FILE *uniq_tmpfile(struct uniq_ctx *ctx){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/shellax-uniq-XXXXXX", ctx->tmpdir);
+	int fd = mkstemp(path);
+	if(fd < 0)
+		return NULL;
+	unlink(path); //gone as soon as we close it
+	return fdopen(fd, "w+");
+}
 
-	if(strcmp(command->name, "wiseman") == 0){
-		wiseman(command);
-		return SUCCESS;
+static void rec_write(FILE *f, uint64_t first, uint64_t count, const char *key, size_t len){
+	uint64_t header[3] = { first, count, len };
+	fwrite(header, sizeof(header), 1, f);
+	fwrite(key, 1, len, f);
+}
+
+//Reads the next record into *buf, false at end of file
+static bool rec_read(FILE *f, uint64_t *first, uint64_t *count, char **buf, size_t *cap, size_t *len){
+	uint64_t header[3];
+	if(fread(header, sizeof(header), 1, f) != 1)
+		return false;
+	*first = header[0];
+	*count = header[1];
+	*len = header[2];
+	if(*len > *cap){
+		*cap = *len * 2;
+		*buf = realloc(*buf, *cap);
 	}
+	return fread(*buf, 1, *len, f) == *len;
+}
 
+static bool src_next(struct uniq_source *src, const char **key, size_t *len, uint64_t *first, uint64_t *count){
+	if(src->lr){
+		ssize_t l = lr_next(src->lr, key);
+		if(l < 0) return false;
+		*len = l;
+		*first = src->seq++;
+		*count = 1;
+		return true;
+	}
+	if(!rec_read(src->records, first, count, &src->buf, &src->cap, len))
+		return false;
+	*key = src->buf;
+	return true;
+}
 
-	pid_t pid=fork();
-	if (pid==0) // child
-	{
-		/// This shows how to do exec with environ (but is not available on MacOs)
-		// extern char** environ; // environment variables
-		// execvpe(command->name, command->args, environ); // exec+args+path+environ
+static void sink_put(struct uniq_sink *sink, uint64_t first, uint64_t count, const char *key, size_t len){
+	if(sink->records)
+		rec_write(sink->records, first, count, key, len);
+	else
+		uniq_emit(sink->ob, key, len, count, sink->flags);
+}
 
-		/// This shows how to do exec with auto-path resolve
-		// add a NULL argument to the end of args, and the name to the beginning
-		// as required by exec
+//Output order: first-seen, or with --sort-by-count most frequent first
+static int uniq_order(int flags, uint64_t afirst, uint64_t acount, uint64_t bfirst, uint64_t bcount){
+	if((flags & UNIQ_SORT_BY_COUNT) && acount != bcount)
+		return acount > bcount ? -1 : 1;
+	return afirst < bfirst ? -1 : afirst > bfirst;
+}
 
+static struct uniq_entry *uniq_sort_entries; //qsort has no context argument
+static int uniq_sort_flags;
+static int uniq_cmp_index(const void *a, const void *b){
+	const struct uniq_entry *x = &uniq_sort_entries[*(const size_t *)a];
+	const struct uniq_entry *y = &uniq_sort_entries[*(const size_t *)b];
+	return uniq_order(uniq_sort_flags, x->first, x->count, y->first, y->count);
+}
 
-		if(strcmp(command->name, "chatroom") == 0){
-			chatroom(command);
-			return SUCCESS;
+//k-way merge of ordered record files into the sink
+static void uniq_merge(FILE **runs, int n, struct uniq_sink *sink){
+	struct {
+		uint64_t first, count;
+		char *buf;
+		size_t cap, len;
+		bool live;
+	} head[UNIQ_PARTITIONS];
+	for(int i = 0; i < n; i++){
+		head[i].buf = NULL;
+		head[i].cap = 0;
+		rewind(runs[i]);
+		head[i].live = rec_read(runs[i], &head[i].first, &head[i].count, &head[i].buf, &head[i].cap, &head[i].len);
+	}
+	while(1){
+		int best = -1;
+		for(int i = 0; i < n; i++){
+			if(head[i].live && (best < 0 || uniq_order(sink->flags, head[i].first, head[i].count,
+							head[best].first, head[best].count) < 0))
+				best = i;
 		}
-		// increase args size by 2
-		command->args=(char **)realloc(
-				command->args, sizeof(char *)*(command->arg_count+=2));
+		if(best < 0) break;
+		sink_put(sink, head[best].first, head[best].count, head[best].buf, head[best].len);
+		head[best].live = rec_read(runs[best], &head[best].first, &head[best].count,
+				&head[best].buf, &head[best].cap, &head[best].len);
+	}
+	for(int i = 0; i < n; i++)
+		free(head[i].buf);
+}
 
-		// shift everything forward by 1
-		for (int i=command->arg_count-2;i>0;--i)
-			command->args[i]=command->args[i-1];
+/**
+ * Dedup one source into the sink. When the table outgrows max_memory the
+ * rest of the source is spread over UNIQ_PARTITIONS temp files by hash;
+ * each partition is then deduped on its own and the ordered results are
+ * merged, so memory stays bounded by the cap for any cardinality.
+ * @param  ctx   shared table and options
+ * @param  src   lines or records to dedup
+ * @param  level partitioning depth
+ * @param  sink  where ordered results go
+ * @return       SUCCESS or EXIT if spilling failed
+ */
+static int uniq_global_pass(struct uniq_ctx *ctx, struct uniq_source *src, int level, struct uniq_sink *sink){
+	struct uniq_table *t = &ctx->table;
+	FILE *parts[UNIQ_PARTITIONS] = { NULL };
+	bool spilled = false;
+	uint64_t seed = uniq_seed(level);
+	const char *key;
+	size_t len;
+	uint64_t first, count;
 
-		if(strcmp(command->name, "guessthenumber") == 0) {	
-			guessTheNumber(command);
-			return SUCCESS;
+	ut_reset(t);
+	while(src_next(src, &key, &len, &first, &count)){
+		uint64_t h = uniq_hash(key, len, ctx->flags, seed);
+		if(spilled){
+			rec_write(parts[(h >> 32) % UNIQ_PARTITIONS], first, count, key, len);
+			continue;
+		}
+		ut_add(t, h, key, len, first, count, ctx->flags);
+		if(ut_memory(t) > ctx->max_memory && level < UNIQ_MAX_LEVEL){
+			for(int p = 0; p < UNIQ_PARTITIONS; p++){
+				if((parts[p] = uniq_tmpfile(ctx)) == NULL){
+					fprintf(stderr, "-%s: uniq: %s: %s\n", sysname, ctx->tmpdir, strerror(errno));
+					while(p-- > 0) fclose(parts[p]);
+					return EXIT;
+				}
+			}
+			for(size_t i = 0; i < t->count; i++){
+				struct uniq_entry *e = &t->entries[i];
+				rec_write(parts[(e->hash >> 32) % UNIQ_PARTITIONS], e->first, e->count, e->key, e->len);
+			}
+			ut_reset(t);
+			spilled = true;
 		}
+	}
 
-		if(strcmp(command->name, "rps") == 0){
-			rps(command);
+	if(!spilled){
+		//level 0 entries are already in first-seen order
+		if(level == 0 && !(ctx->flags & UNIQ_SORT_BY_COUNT)){
+			for(size_t i = 0; i < t->count; i++)
+				sink_put(sink, t->entries[i].first, t->entries[i].count, t->entries[i].key, t->entries[i].len);
 			return SUCCESS;
 		}
-		// set args[0] as a copy of name
-		command->args[0]=strdup(command->name);
-		// set args[arg_count-1] (last) to NULL
-		command->args[command->arg_count-1]=NULL;
+		size_t *order = malloc(sizeof(size_t) * (t->count ? t->count : 1));
+		for(size_t i = 0; i < t->count; i++)
+			order[i] = i;
+		uniq_sort_entries = t->entries;
+		uniq_sort_flags = ctx->flags;
+		qsort(order, t->count, sizeof(size_t), uniq_cmp_index);
+		for(size_t i = 0; i < t->count; i++){
+			struct uniq_entry *e = &t->entries[order[i]];
+			sink_put(sink, e->first, e->count, e->key, e->len);
+		}
+		free(order);
+		return SUCCESS;
+	}
+
+	int status = SUCCESS;
+	FILE *results[UNIQ_PARTITIONS];
+	for(int p = 0; p < UNIQ_PARTITIONS; p++){
+		results[p] = uniq_tmpfile(ctx);
+		if(results[p] == NULL){
+			fprintf(stderr, "-%s: uniq: %s: %s\n", sysname, ctx->tmpdir, strerror(errno));
+			status = EXIT;
+			for(int q = p; q < UNIQ_PARTITIONS; q++) fclose(parts[q]);
+			for(int q = 0; q < p; q++) fclose(results[q]);
+			return status;
+		}
+		rewind(parts[p]);
+		struct uniq_source sub = { NULL, parts[p], 0, NULL, 0 };
+		struct uniq_sink part_sink = { results[p], NULL, ctx->flags };
+		if(uniq_global_pass(ctx, &sub, level + 1, &part_sink) != SUCCESS)
+			status = EXIT;
+		free(sub.buf);
+		fclose(parts[p]);
+		fflush(results[p]);
+	}
+	uniq_merge(results, UNIQ_PARTITIONS, sink);
+	for(int p = 0; p < UNIQ_PARTITIONS; p++)
+		fclose(results[p]);
+	return status;
+}
+
+static int uniq_global(struct line_reader *lr, struct out_buf *ob, int flags, size_t max_memory){
+	struct uniq_ctx ctx = { .flags = flags, .max_memory = max_memory };
+	ctx.tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	struct uniq_source src = { lr, NULL, 0, NULL, 0 };
+	struct uniq_sink sink = { NULL, ob, flags };
+	int status = uniq_global_pass(&ctx, &src, 0, &sink);
+	ut_free(&ctx.table);
+	return status;
+}
+
+//Parses sizes like 512M, returns 0 on error
+static size_t parse_size(const char *s){
+	char *end;
+	unsigned long long n = strtoull(s, &end, 10);
+	switch(*end){
+		case 'k': case 'K': n <<= 10; end++; break;
+		case 'm': case 'M': n <<= 20; end++; break;
+		case 'g': case 'G': n <<= 30; end++; break;
+	}
+	return *end == '\0' ? n : 0;
+}
+
+//MYUNIQ -j: parallel run counting over an mmapped file
+#define UNIQ_SEGMENT_SIZE ((size_t)32 << 20) // work unit handed to a thread
+#define UNIQ_MAX_JOBS 256
+
+//One newline-aligned slice of the file. Runs entirely inside it are
+//formatted by the worker; the first and last run may continue in the
+//neighbouring segments, so they are left for the merge.
+struct uniq_segment {
+	const char *begin, *end;
+	const char *first, *last;
+	size_t first_len, last_len;
+	unsigned long first_count, last_count;
+	int runs;
+	struct out_buf *middle; // formatted runs between first and last
+	bool done;
+};
+
+struct uniq_parallel {
+	struct uniq_segment *segs;
+	int nsegs, next, written, window;
+	int flags;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void uniq_count_segment(struct uniq_segment *seg, int flags){
+	const char *p = seg->begin, *prev = NULL;
+	size_t prev_len = 0;
+	unsigned long count = 0;
+	seg->middle = ob_open(-1);
+	seg->runs = 0;
+	while(p < seg->end){
+		const char *nl = scan_newline(p, seg->end);
+		const char *stop = nl ? nl : seg->end;
+		size_t len = stop - p;
+		if(count > 0 && uniq_equal(prev, prev_len, p, len, flags)){
+			count++;
+		} else {
+			if(count > 0){
+				if(seg->runs == 1){
+					seg->first = prev;
+					seg->first_len = prev_len;
+					seg->first_count = count;
+				} else {
+					uniq_emit(seg->middle, prev, prev_len, count, flags);
+				}
+			}
+			seg->runs++;
+			prev = p;
+			prev_len = len;
+			count = 1;
+		}
+		p = nl ? nl + 1 : seg->end;
+	}
+	if(seg->runs == 1){
+		seg->first = prev;
+		seg->first_len = prev_len;
+		seg->first_count = count;
+	} else if(seg->runs > 1){
+		seg->last = prev;
+		seg->last_len = prev_len;
+		seg->last_count = count;
+	}
+	ob_flush(seg->middle);
+}
 
-		if(strcmp(command->name, "fortune") == 0 || strcmp(command->name, "cowsay") == 0){
-			strcpy(pathname, "/usr/games/");
-			strcat(pathname, command->name);	
-			execv(pathname, command->args);
-		}	
-		io_redirect(command);		
-		if(command->next != NULL){
-			int fd[2];
-			//printf("pathin of pipe is %s\n", pathname);
-			pipe_command(command, pathname, fd);
+//Workers take segments in order but never run more than window ahead of
+//the writer, so buffered output stays bounded
+static void *uniq_worker(void *arg){
+	struct uniq_parallel *up = arg;
+	while(1){
+		pthread_mutex_lock(&up->lock);
+		while(up->next < up->nsegs && up->next >= up->written + up->window)
+			pthread_cond_wait(&up->cond, &up->lock);
+		if(up->next >= up->nsegs){
+			pthread_mutex_unlock(&up->lock);
+			return NULL;
 		}
-		if(strcmp(pathname, "/usr/bin/") == 0){
-			strcat(pathname, command->name);
-			execv(pathname, command->args);
+		struct uniq_segment *seg = &up->segs[up->next++];
+		pthread_mutex_unlock(&up->lock);
+
+		uniq_count_segment(seg, up->flags);
+
+		pthread_mutex_lock(&up->lock);
+		seg->done = true;
+		pthread_cond_broadcast(&up->cond);
+		pthread_mutex_unlock(&up->lock);
+	}
+}
+
+/**
+ * uniq over a mapped file with jobs threads. Segments are counted in
+ * parallel and stitched together in order, joining runs that cross
+ * segment boundaries, so the output is identical to the sequential pass.
+ * @param  lr    mapped reader
+ * @param  ob    output
+ * @param  flags UNIQ_* flags
+ * @param  jobs  worker threads
+ * @return       SUCCESS
+ */
+static int uniq_parallel(struct line_reader *lr, struct out_buf *ob, int flags, int jobs){
+	const char *data = lr->buf + lr->start, *end = lr->buf + lr->end;
+	size_t size = end - data;
+	size_t seg_size = size / jobs < UNIQ_SEGMENT_SIZE ? size / jobs + 1 : UNIQ_SEGMENT_SIZE;
+	struct uniq_parallel up = { .flags = flags, .window = 2 * jobs };
+	up.nsegs = size / seg_size + 1;
+	up.segs = calloc(up.nsegs, sizeof(struct uniq_segment));
+	pthread_mutex_init(&up.lock, NULL);
+	pthread_cond_init(&up.cond, NULL);
+
+	//cut after the first newline past each nominal boundary
+	const char *p = data;
+	int n = 0;
+	while(p < end){
+		const char *cut = end - p > (ptrdiff_t)seg_size ? p + seg_size : end;
+		if(cut < end){
+			const char *nl = scan_newline(cut, end);
+			cut = nl ? nl + 1 : end;
 		}
+		up.segs[n].begin = p;
+		up.segs[n].end = cut;
+		n++;
+		p = cut;
+	}
+	up.nsegs = n;
 
-		exit(0);
+	pthread_t threads[UNIQ_MAX_JOBS];
+	int started = 0;
+	for(int i = 0; i < jobs && i < n; i++)
+		if(pthread_create(&threads[started], NULL, uniq_worker, &up) == 0)
+			started++;
+	if(started == 0){ //no threads, do it here: nothing is written until it
+		up.window = n; //returns, so it must not wait for the writer
+		uniq_worker(&up);
 	}
-	else {
-		int status;
-		if(!command->background){
-			waitpid(pid, NULL, 0);
+
+	const char *carry = NULL;
+	size_t carry_len = 0;
+	unsigned long carry_count = 0;
+	for(int i = 0; i < n; i++){
+		struct uniq_segment *seg = &up.segs[i];
+		pthread_mutex_lock(&up.lock);
+		while(!seg->done)
+			pthread_cond_wait(&up.cond, &up.lock);
+		pthread_mutex_unlock(&up.lock);
+
+		if(seg->runs > 0){
+			if(carry_count > 0 && uniq_equal(carry, carry_len, seg->first, seg->first_len, flags)){
+				carry_count += seg->first_count;
+			} else {
+				if(carry_count > 0)
+					uniq_emit(ob, carry, carry_len, carry_count, flags);
+				carry = seg->first;
+				carry_len = seg->first_len;
+				carry_count = seg->first_count;
+			}
+			if(seg->runs > 1){
+				uniq_emit(ob, carry, carry_len, carry_count, flags);
+				ob_write(ob, seg->middle->mem, seg->middle->mem_len);
+				carry = seg->last;
+				carry_len = seg->last_len;
+				carry_count = seg->last_count;
+			}
 		}
-		return SUCCESS;
+		ob_close(seg->middle);
+
+		pthread_mutex_lock(&up.lock);
+		up.written++;
+		pthread_cond_broadcast(&up.cond);
+		pthread_mutex_unlock(&up.lock);
+	}
+	if(carry_count > 0)
+		uniq_emit(ob, carry, carry_len, carry_count, flags);
+
+	for(int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&up.lock);
+	pthread_cond_destroy(&up.cond);
+	free(up.segs);
+	lr->start = lr->end; //consumed
+	return SUCCESS;
+}
+
+/**
+ * uniq [-c] [-d] [-u] [-i] [-j N] [--global [--sort-by-count] [--max-memory SIZE]] [file]
+ * Single pass over sorted input: each line is only compared with the
+ * previous one, so memory stays at the longest line and input can be a
+ * pipe of any size. Reads stdin without a file or with "-".
+ * -j N counts runs of a regular file on N threads.
+ * --global dedups unsorted input in first-seen order instead, spilling
+ * to temp files past --max-memory (default 512M).
+ * @param  command [description]
+ * @param  in_fd   stdin of the builtin
+ * @param  out_fd  stdout of the builtin
+ * @return         SUCCESS or EXIT on error
+ */
+int myuniq(struct command_t *command, int in_fd, int out_fd){
+	int flags = 0;
+	const char *filename = NULL;
+	size_t max_memory = UNIQ_DEFAULT_MAX_MEMORY;
+	int jobs = 1;
+
+	for(int i = 0; i < command->arg_count; i++){
+		char *arg = command->args[i];
+		if(strncmp(arg, "-j", 2) == 0){
+			const char *n = arg[2] ? arg + 2 : (i + 1 < command->arg_count ? command->args[++i] : "");
+			jobs = atoi(n);
+			if(jobs < 1 || jobs > UNIQ_MAX_JOBS){
+				fprintf(stderr, "-%s: uniq: -j needs a thread count from 1 to %d\n", sysname, UNIQ_MAX_JOBS);
+				return EXIT;
+			}
+			continue;
+		}
+		if(strcmp(arg, "--count") == 0) flags |= UNIQ_COUNT;
+		else if(strcmp(arg, "--repeated") == 0) flags |= UNIQ_REPEATED;
+		else if(strcmp(arg, "--unique") == 0) flags |= UNIQ_UNIQUE;
+		else if(strcmp(arg, "--ignore-case") == 0) flags |= UNIQ_IGNORE_CASE;
+		else if(strcmp(arg, "--global") == 0) flags |= UNIQ_GLOBAL;
+		else if(strcmp(arg, "--sort-by-count") == 0) flags |= UNIQ_GLOBAL | UNIQ_SORT_BY_COUNT;
+		else if(strcmp(arg, "--max-memory") == 0){
+			if(i + 1 == command->arg_count || (max_memory = parse_size(command->args[++i])) == 0){
+				fprintf(stderr, "-%s: uniq: --max-memory needs a size like 256M\n", sysname);
+				return EXIT;
+			}
+		}
+		else if(arg[0] == '-' && arg[1] != '\0'){
+			for(char *f = arg + 1; *f; f++){ //combined short flags like -cd
+				if(*f == 'c') flags |= UNIQ_COUNT;
+				else if(*f == 'd') flags |= UNIQ_REPEATED;
+				else if(*f == 'u') flags |= UNIQ_UNIQUE;
+				else if(*f == 'i') flags |= UNIQ_IGNORE_CASE;
+				else {
+					fprintf(stderr, "-%s: uniq: invalid option -- '%c'\n", sysname, *f);
+					return EXIT;
+				}
+			}
+		}
+		else if(filename == NULL) filename = arg;
+		else {
+			fprintf(stderr, "-%s: uniq: extra operand '%s'\n", sysname, arg);
+			return EXIT;
+		}
+	}
+
+	int fd = in_fd;
+	if(filename != NULL && strcmp(filename, "-") != 0){
+		fd = open(filename, O_RDONLY | O_CLOEXEC);
+		if(fd < 0){
+			fprintf(stderr, "-%s: uniq: %s: %s\n", sysname, filename, strerror(errno));
+			return EXIT;
+		}
+	}
+
+	struct line_reader lr;
+	lr_init(&lr, fd);
+	struct out_buf *ob = ob_open(out_fd);
+
+	if(flags & UNIQ_GLOBAL){
+		int status = uniq_global(&lr, ob, flags, max_memory);
+		lr_free(&lr);
+		if(fd != in_fd)
+			close(fd);
+		return ob_close(ob) == 0 ? status : EXIT;
+	}
+
+	if(jobs > 1 && lr.mapped){
+		int status = uniq_parallel(&lr, ob, flags, jobs);
+		lr_free(&lr);
+		if(fd != in_fd)
+			close(fd);
+		return ob_close(ob) == 0 ? status : EXIT;
+	}
 
+	//Mapped lines are compared in place; a reused read buffer needs the
+	//current run's line kept in a copy
+	char *copy = NULL;
+	const char *prev = NULL;
+	size_t copy_cap = 0, prev_len = 0;
+	unsigned long count = 0;
+	const char *line;
+	ssize_t len;
+	while((len = lr_next(&lr, &line)) >= 0){
+		if(count > 0 && uniq_equal(prev, prev_len, line, len, flags)){
+			count++;
+			continue;
+		}
+		if(count > 0)
+			uniq_emit(ob, prev, prev_len, count, flags);
+		if(lr.stable){
+			prev = line;
+		} else {
+			if((size_t)len > copy_cap){
+				copy_cap = len * 2;
+				copy = realloc(copy, copy_cap);
+			}
+			memcpy(copy, line, len);
+			prev = copy;
+		}
+		prev_len = len;
+		count = 1;
 	}
-	printf("-%s: %s: command not found\n",sysname, command->name);
-	return UNKNOWN;
-}	
+	if(count > 0)
+		uniq_emit(ob, prev, prev_len, count, flags);
+
+	free(copy);
+	lr_free(&lr);
+	if(fd != in_fd)
+		close(fd);
+	return ob_close(ob) == 0 ? SUCCESS : EXIT;
+}
+//SORT BUILTIN: in-memory parallel sort, external merge sort past the buffer size
+#define SORT_NUMERIC 1 // -n
+#define SORT_REVERSE 2 // -r
+#define SORT_UNIQUE 4 // -u: keep the first of lines with equal keys
+#define SORT_BLANKS 8 // -b: leading blanks are not part of a -k key
+#define SORT_DEFAULT_BUFFER ((size_t)512 << 20)
+#define SORT_FANIN 64 // runs merged at once, bounds open files
+#define SORT_MAX_JOBS 64
+#define SORT_MIN_PARALLEL 65536 // lines below which threads don't pay off
+
+struct sort_opts {
+	int flags;
+	int key_start, key_end; // -k fields, 1-based, 0 for the whole line / end of line
+	size_t buffer; // -S
+	int jobs; // --parallel
+	const char *tmpdir;
+};
+
+struct sort_line {
+	const char *p;
+	size_t len;
+	const char *key;
+	size_t key_len;
+	double num; // parsed key for -n
+	size_t seq; // input order (run index while merging), keeps -u stable
+};
+
+//Locate the -k key and, with -n, its numeric value
+static void sort_prepare(struct sort_line *l, const struct sort_opts *o){
+	const char *p = l->p, *end = l->p + l->len;
+	l->key = p;
+	l->key_len = l->len;
+	if(o->key_start > 0){
+		//a field is a run of non-blanks and the blanks before it, as in POSIX sort
+		for(int field = 1; field < o->key_start && p < end; field++){
+			while(p < end && (*p == ' ' || *p == '\t')) p++;
+			while(p < end && *p != ' ' && *p != '\t') p++;
+		}
+		if(o->flags & SORT_BLANKS)
+			while(p < end && (*p == ' ' || *p == '\t')) p++;
+		const char *kend = end;
+		if(o->key_end >= o->key_start){
+			const char *q = p;
+			for(int f = o->key_start; f <= o->key_end && q < end; f++){
+				while(q < end && (*q == ' ' || *q == '\t')) q++;
+				while(q < end && *q != ' ' && *q != '\t') q++;
+			}
+			kend = q;
+		}
+		l->key = p;
+		l->key_len = kend - p;
+	}
+	if(o->flags & SORT_NUMERIC){
+		char tmp[64];
+		size_t n = l->key_len < sizeof(tmp) - 1 ? l->key_len : sizeof(tmp) - 1;
+		memcpy(tmp, l->key, n);
+		tmp[n] = '\0';
+		char *stop;
+		l->num = strtod(tmp, &stop);
+		if(stop == tmp) l->num = 0; //not a number sorts as zero, like sort -n
+	}
+}
+
+static int sort_key_cmp(const struct sort_line *a, const struct sort_line *b, const struct sort_opts *o){
+	if(o->flags & SORT_NUMERIC){
+		if(a->num != b->num)
+			return a->num < b->num ? -1 : 1;
+		return 0;
+	}
+	size_t n = a->key_len < b->key_len ? a->key_len : b->key_len;
+	int r = memcmp(a->key, b->key, n);
+	if(r) return r;
+	return a->key_len < b->key_len ? -1 : a->key_len > b->key_len;
+}
+
+//Full order: key, then the whole line as a last resort (bytewise, like LC_ALL=C)
+static int sort_cmp(const void *x, const void *y, void *arg){
+	const struct sort_line *a = x, *b = y;
+	const struct sort_opts *o = arg;
+	int r = sort_key_cmp(a, b, o);
+	if(r == 0 && !(o->flags & SORT_UNIQUE)){
+		size_t n = a->len < b->len ? a->len : b->len;
+		r = memcmp(a->p, b->p, n);
+		if(r == 0) r = a->len < b->len ? -1 : a->len > b->len;
+	}
+	if(o->flags & SORT_REVERSE) r = -r;
+	if(r == 0) r = a->seq < b->seq ? -1 : a->seq > b->seq;
+	return r;
+}
+
+struct sort_task {
+	struct sort_line *lines, *a, *b, *out;
+	size_t n, na, nb;
+	const struct sort_opts *o;
+};
+
+static void *sort_chunk(void *arg){
+	struct sort_task *t = arg;
+	qsort_r(t->lines, t->n, sizeof(struct sort_line), sort_cmp, (void *)t->o);
+	return NULL;
+}
+
+static void *sort_merge_pair(void *arg){
+	struct sort_task *t = arg;
+	size_t i = 0, j = 0, k = 0;
+	while(i < t->na && j < t->nb)
+		t->out[k++] = sort_cmp(&t->b[j], &t->a[i], (void *)t->o) < 0 ? t->b[j++] : t->a[i++];
+	memcpy(t->out + k, t->a + i, (t->na - i) * sizeof(struct sort_line));
+	k += t->na - i;
+	memcpy(t->out + k, t->b + j, (t->nb - j) * sizeof(struct sort_line));
+	return NULL;
+}
+
+/**
+ * Sort lines in place: chunks are sorted on separate threads, then merged
+ * pairwise, each merge of a round on its own thread
+ * @param lines array to sort
+ * @param n     number of lines
+ * @param o     options
+ */
+static void sort_lines(struct sort_line *lines, size_t n, const struct sort_opts *o){
+	int jobs = o->jobs;
+	if(n < SORT_MIN_PARALLEL || jobs < 2){
+		qsort_r(lines, n, sizeof(struct sort_line), sort_cmp, (void *)o);
+		return;
+	}
+	size_t bounds[SORT_MAX_JOBS + 1];
+	struct sort_task tasks[SORT_MAX_JOBS];
+	pthread_t threads[SORT_MAX_JOBS];
+	bool running[SORT_MAX_JOBS];
+	for(int i = 0; i <= jobs; i++)
+		bounds[i] = n * i / jobs;
+	for(int i = 0; i < jobs; i++){
+		tasks[i] = (struct sort_task){ .lines = lines + bounds[i], .n = bounds[i+1] - bounds[i], .o = o };
+		running[i] = pthread_create(&threads[i], NULL, sort_chunk, &tasks[i]) == 0;
+		if(!running[i]) sort_chunk(&tasks[i]);
+	}
+	for(int i = 0; i < jobs; i++)
+		if(running[i]) pthread_join(threads[i], NULL);
+
+	struct sort_line *tmp = malloc(n * sizeof(struct sort_line)), *src = lines, *dst = tmp;
+	int parts = jobs;
+	while(parts > 1){
+		int merged = 0;
+		for(int i = 0; i < parts; i += 2, merged++){
+			size_t lo = bounds[i], mid = bounds[i + 1 < parts ? i + 1 : parts];
+			size_t hi = bounds[i + 2 < parts ? i + 2 : parts];
+			tasks[merged] = (struct sort_task){ .a = src + lo, .na = mid - lo, .b = src + mid,
+				.nb = hi - mid, .out = dst + lo, .o = o };
+			running[merged] = pthread_create(&threads[merged], NULL, sort_merge_pair, &tasks[merged]) == 0;
+			if(!running[merged]) sort_merge_pair(&tasks[merged]);
+		}
+		for(int i = 0; i < merged; i++)
+			if(running[i]) pthread_join(threads[i], NULL);
+		for(int i = 0; i < merged; i++)
+			bounds[i] = bounds[2 * i];
+		bounds[merged] = n;
+		parts = merged;
+		struct sort_line *swap = src;
+		src = dst;
+		dst = swap;
+	}
+	if(src != lines)
+		memcpy(lines, src, n * sizeof(struct sort_line));
+	free(tmp);
+}
+
+//Writes lines, dropping equal keys with -u; *last carries across calls
+static void sort_output(struct out_buf *ob, struct sort_line *l, struct sort_line *last,
+		bool *have_last, const struct sort_opts *o){
+	if((o->flags & SORT_UNIQUE) && *have_last && sort_key_cmp(last, l, o) == 0)
+		return;
+	ob_write(ob, l->p, l->len);
+	ob_putc(ob, '\n');
+	*last = *l;
+	*have_last = true;
+}
+
+//One sorted input of the merge: a spilled run file or the final in-memory batch
+struct sort_run {
+	struct line_reader lr;
+	int fd;
+	struct sort_line *mem;
+	size_t mem_n, mem_i;
+	size_t index; // runs are numbered in input order
+	struct sort_line head;
+};
+
+static bool sort_run_next(struct sort_run *r, const struct sort_opts *o){
+	if(r->mem){
+		if(r->mem_i == r->mem_n) return false;
+		r->head = r->mem[r->mem_i++];
+		r->head.seq = r->index;
+		return true;
+	}
+	const char *p;
+	ssize_t len = lr_next(&r->lr, &p);
+	if(len < 0) return false;
+	r->head.p = p;
+	r->head.len = len;
+	r->head.seq = r->index; //lines within a run are already in order
+	sort_prepare(&r->head, o);
+	return true;
+}
+
+static void sort_heap_down(struct sort_run **heap, int n, int i, const struct sort_opts *o){
+	while(1){
+		int l = 2 * i + 1, r = l + 1, m = i;
+		if(l < n && sort_cmp(&heap[l]->head, &heap[m]->head, (void *)o) < 0) m = l;
+		if(r < n && sort_cmp(&heap[r]->head, &heap[m]->head, (void *)o) < 0) m = r;
+		if(m == i) return;
+		struct sort_run *t = heap[i];
+		heap[i] = heap[m];
+		heap[m] = t;
+		i = m;
+	}
+}
+
+//k-way heap merge of runs; run files stay mapped, so output lines stay valid
+static void sort_merge(struct sort_run *runs, int n, struct out_buf *ob, const struct sort_opts *o){
+	struct sort_run **heap = malloc(sizeof(struct sort_run *) * n);
+	int h = 0;
+	for(int i = 0; i < n; i++)
+		if(sort_run_next(&runs[i], o))
+			heap[h++] = &runs[i];
+	for(int i = h / 2 - 1; i >= 0; i--)
+		sort_heap_down(heap, h, i, o);
+	struct sort_line last;
+	bool have_last = false;
+	while(h > 0){
+		sort_output(ob, &heap[0]->head, &last, &have_last, o);
+		if(!sort_run_next(heap[0], o))
+			heap[0] = heap[--h];
+		sort_heap_down(heap, h, 0, o);
+	}
+	free(heap);
+}
+
+static int sort_tmpfd(const struct sort_opts *o){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/shellax-sort-XXXXXX", o->tmpdir);
+	int fd = mkstemp(path);
+	if(fd >= 0) unlink(path);
+	return fd;
+}
+
+static void sort_open_run(struct sort_run *r, int fd, size_t index){
+	memset(r, 0, sizeof(struct sort_run));
+	r->fd = fd;
+	r->index = index;
+	lseek(fd, 0, SEEK_SET);
+	lr_init(&r->lr, fd);
+}
+
+static void sort_close_run(struct sort_run *r){
+	if(r->mem) return;
+	lr_free(&r->lr);
+	close(r->fd);
+}
+
+struct sort_state {
+	struct sort_opts *o;
+	struct arena copies; // lines from unmappable input
+	struct sort_line *lines;
+	size_t n, cap, bytes;
+	int *run_fds;
+	int nruns;
+	struct line_reader *readers; // mapped inputs must outlive the sort
+	int nreaders;
+};
+
+//Sort the batch in memory and write it to a new run file
+static int sort_spill(struct sort_state *s){
+	sort_lines(s->lines, s->n, s->o);
+	int fd = sort_tmpfd(s->o);
+	if(fd < 0){
+		fprintf(stderr, "-%s: sort: %s: %s\n", sysname, s->o->tmpdir, strerror(errno));
+		return EXIT;
+	}
+	struct out_buf *ob = ob_open(fd);
+	struct sort_line last;
+	bool have_last = false;
+	for(size_t i = 0; i < s->n; i++)
+		sort_output(ob, &s->lines[i], &last, &have_last, s->o);
+	if(ob_close(ob) != 0){
+		fprintf(stderr, "-%s: sort: %s: %s\n", sysname, s->o->tmpdir, strerror(errno));
+		close(fd);
+		return EXIT;
+	}
+	s->run_fds = realloc(s->run_fds, sizeof(int) * (s->nruns + 1));
+	s->run_fds[s->nruns++] = fd;
+	s->n = s->bytes = 0;
+	arena_reset(&s->copies);
+	return SUCCESS;
+}
+
+//Merge the first SORT_FANIN runs into one until few enough are left
+static int sort_reduce_runs(struct sort_state *s){
+	while(s->nruns > SORT_FANIN){
+		struct sort_run runs[SORT_FANIN];
+		int fd = sort_tmpfd(s->o);
+		if(fd < 0){
+			fprintf(stderr, "-%s: sort: %s: %s\n", sysname, s->o->tmpdir, strerror(errno));
+			return EXIT;
+		}
+		for(int i = 0; i < SORT_FANIN; i++)
+			sort_open_run(&runs[i], s->run_fds[i], i);
+		struct out_buf *ob = ob_open(fd);
+		sort_merge(runs, SORT_FANIN, ob, s->o);
+		int r = ob_close(ob);
+		for(int i = 0; i < SORT_FANIN; i++)
+			sort_close_run(&runs[i]);
+		if(r != 0){
+			fprintf(stderr, "-%s: sort: %s: %s\n", sysname, s->o->tmpdir, strerror(errno));
+			close(fd);
+			return EXIT;
+		}
+		//the merged run holds the oldest input, keep it first
+		memmove(s->run_fds + 1, s->run_fds + SORT_FANIN, sizeof(int) * (s->nruns - SORT_FANIN));
+		s->nruns -= SORT_FANIN - 1;
+		s->run_fds[0] = fd;
+	}
+	return SUCCESS;
+}
+
+static int sort_read(struct sort_state *s, int fd){
+	s->readers = realloc(s->readers, sizeof(struct line_reader) * (s->nreaders + 1));
+	struct line_reader *lr = &s->readers[s->nreaders++];
+	lr_init(lr, fd);
+	const char *p;
+	ssize_t len;
+	while((len = lr_next(lr, &p)) >= 0){
+		if(!lr->stable){
+			char *copy = arena_alloc(&s->copies, len ? len : 1);
+			memcpy(copy, p, len);
+			p = copy;
+		}
+		if(s->n == s->cap){
+			s->cap = s->cap ? s->cap * 2 : 4096;
+			s->lines = realloc(s->lines, s->cap * sizeof(struct sort_line));
+		}
+		struct sort_line *l = &s->lines[s->n];
+		l->seq = s->n++;
+		l->p = p;
+		l->len = len;
+		sort_prepare(l, s->o);
+		s->bytes += len + sizeof(struct sort_line);
+		if(s->bytes > s->o->buffer && sort_spill(s) != SUCCESS)
+			return EXIT;
+	}
+	return SUCCESS;
+}
+
+static bool sort_parse_key(const char *spec, struct sort_opts *o){
+	char *end;
+	o->key_start = strtol(spec, &end, 10);
+	o->key_end = 0;
+	if(*end == ','){
+		o->key_end = strtol(end + 1, &end, 10);
+		if(o->key_end < o->key_start) return false;
+	}
+	return o->key_start > 0 && *end == '\0';
+}
+
+//Options the builtin doesn't know, key modifiers like -k2n and -t among
+//them, run the PATH sort
+static bool sort_handles(struct command_t *command){
+	struct sort_opts o;
+	for(int i = 0; i < command->arg_count; i++){
+		const char *arg = command->args[i];
+		if(strncmp(arg, "--parallel=", 11) == 0){
+			if(atoi(arg + 11) < 1 || atoi(arg + 11) > SORT_MAX_JOBS) return false;
+		}
+		else if(strcmp(arg, "-k") == 0 || strcmp(arg, "-S") == 0){
+			if(i + 1 == command->arg_count) return false;
+			if(arg[1] == 'k' && !sort_parse_key(command->args[++i], &o)) return false;
+			if(arg[1] == 'S' && parse_size(command->args[++i]) == 0) return false;
+		}
+		else if(arg[0] == '-' && arg[1] != '\0'){
+			for(const char *f = arg + 1; *f; f++){
+				if(*f == 'k'){
+					if(!sort_parse_key(f + 1, &o)) return false;
+					break;
+				}
+				if(*f == 'S'){
+					if(parse_size(f + 1) == 0) return false;
+					break;
+				}
+				if(strchr("nrub", *f) == NULL) return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * sort [-n] [-r] [-u] [-b] [-k N[,M]] [-S size] [--parallel=N] [file...]
+ * Compares bytes (like LC_ALL=C). A -k field keeps its leading blanks
+ * unless -b is given, as POSIX has it; other options and key modifiers
+ * go to the PATH sort through sort_handles. Input that fits in the -S buffer
+ * (default 512M) is sorted in memory on --parallel threads; beyond it,
+ * sorted runs are spilled to $TMPDIR and heap-merged.
+ * @param  command [description]
+ * @param  in_fd   stdin of the builtin
+ * @param  out_fd  stdout of the builtin
+ * @return         SUCCESS or EXIT on error
+ */
+int mysort(struct command_t *command, int in_fd, int out_fd){
+	struct sort_opts o = { .buffer = SORT_DEFAULT_BUFFER };
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	o.jobs = cpus < 1 ? 1 : cpus > SORT_MAX_JOBS ? SORT_MAX_JOBS : cpus;
+	o.tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char **files = malloc(sizeof(char *) * (command->arg_count + 1));
+	int nfiles = 0;
+
+	for(int i = 0; i < command->arg_count; i++){
+		char *arg = command->args[i];
+		if(strncmp(arg, "--parallel=", 11) == 0){
+			o.jobs = atoi(arg + 11);
+			if(o.jobs < 1 || o.jobs > SORT_MAX_JOBS) goto usage;
+		}
+		else if(strcmp(arg, "-k") == 0 || strcmp(arg, "-S") == 0){
+			if(i + 1 == command->arg_count) goto usage;
+			if(arg[1] == 'k' && !sort_parse_key(command->args[++i], &o)) goto usage;
+			if(arg[1] == 'S' && (o.buffer = parse_size(command->args[++i])) == 0) goto usage;
+		}
+		else if(arg[0] == '-' && arg[1] != '\0'){
+			for(char *f = arg + 1; *f; f++){
+				if(*f == 'n') o.flags |= SORT_NUMERIC;
+				else if(*f == 'r') o.flags |= SORT_REVERSE;
+				else if(*f == 'u') o.flags |= SORT_UNIQUE;
+				else if(*f == 'b') o.flags |= SORT_BLANKS;
+				else if(*f == 'k'){ //-k2 or -k2,3
+					if(!sort_parse_key(f + 1, &o)) goto usage;
+					break;
+				}
+				else if(*f == 'S'){
+					if((o.buffer = parse_size(f + 1)) == 0) goto usage;
+					break;
+				}
+				else goto usage;
+			}
+		}
+		else files[nfiles++] = arg;
+	}
+
+	struct sort_state s = { .o = &o };
+	int status = SUCCESS;
+	if(nfiles == 0)
+		files[nfiles++] = "-";
+	for(int i = 0; i < nfiles && status == SUCCESS; i++){
+		int fd = in_fd;
+		if(strcmp(files[i], "-") != 0 && (fd = open(files[i], O_RDONLY | O_CLOEXEC)) < 0){
+			fprintf(stderr, "-%s: sort: %s: %s\n", sysname, files[i], strerror(errno));
+			status = EXIT;
+			break;
+		}
+		status = sort_read(&s, fd); //closed with its reader, mapped lines live until the end
+	}
+
+	if(status == SUCCESS)
+		status = sort_reduce_runs(&s);
+	if(status == SUCCESS){
+		struct out_buf *ob = ob_open(out_fd);
+		sort_lines(s.lines, s.n, &o);
+		if(s.nruns == 0){ //everything fit in memory
+			struct sort_line last;
+			bool have_last = false;
+			for(size_t i = 0; i < s.n; i++)
+				sort_output(ob, &s.lines[i], &last, &have_last, &o);
+		} else {
+			struct sort_run *runs = malloc(sizeof(struct sort_run) * (s.nruns + 1));
+			for(int i = 0; i < s.nruns; i++)
+				sort_open_run(&runs[i], s.run_fds[i], i);
+			memset(&runs[s.nruns], 0, sizeof(struct sort_run));
+			runs[s.nruns].index = s.nruns;
+			runs[s.nruns].mem = s.lines;
+			runs[s.nruns].mem_n = s.n;
+			sort_merge(runs, s.nruns + 1, ob, &o);
+			for(int i = 0; i < s.nruns; i++)
+				sort_close_run(&runs[i]);
+			free(runs);
+			s.nruns = 0;
+		}
+		if(ob_close(ob) != 0)
+			status = EXIT;
+	}
+
+	for(int i = 0; i < s.nruns; i++)
+		close(s.run_fds[i]);
+	for(int i = 0; i < s.nreaders; i++){
+		int fd = s.readers[i].fd;
+		lr_free(&s.readers[i]);
+		if(fd != in_fd)
+			close(fd);
+	}
+	free(s.readers);
+	free(s.run_fds);
+	free(s.lines);
+	arena_free(&s.copies);
+	free(files);
+	return status;
+
+usage:
+	fprintf(stderr, "-%s: sort: usage: sort [-n] [-r] [-u] [-b] [-k N[,M]] [-S size] [--parallel=N] [file...]\n", sysname);
+	free(files);
+	return EXIT;
+}
+
+//CAT AND TEE BUILTINS: data moves between fds inside the kernel. File to
+//file goes through copy_file_range, anything with a pipe on one side through
+//splice, and tee copies pipe buffers to every file with tee(2) before
+//splicing them on; read/write is the fallback for whatever the kernel
+//refuses. Pipes they read or write are grown to PLUMB_PIPE_SIZE so every
+//call moves more. Options they don't know run the PATH command instead.
+#define PLUMB_PIPE_SIZE (1 << 20) // the default pipe-max-size, reachable without privileges
+#define PLUMB_CHUNK ((size_t)1 << 30) // asked for per copy_file_range or splice
+#define PLUMB_BUF_SIZE (128 << 10) // read/write fallback
+
+//The kernel can't do this transfer this way, but read/write can
+static bool plumb_unsupported(int err){
+	return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EBADF;
+}
+
+static void plumb_grow(int fd){
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && fcntl(fd, F_GETPIPE_SZ) < PLUMB_PIPE_SIZE)
+		fcntl(fd, F_SETPIPE_SZ, PLUMB_PIPE_SIZE); // may exceed the per-user limit, then it stays
+}
+
+static int write_all(int fd, const char *buf, size_t n){
+	while(n > 0){
+		ssize_t w = write(fd, buf, n);
+		if(w < 0 && errno == EINTR)
+			continue;
+		if(w < 0)
+			return errno;
+		buf += w;
+		n -= w;
+	}
+	return 0;
+}
+
+static int plumb_read_write(int in, int out){
+	char *buf = malloc(PLUMB_BUF_SIZE);
+	int err = 0;
+	ssize_t n;
+	while(err == 0 && ((n = read(in, buf, PLUMB_BUF_SIZE)) > 0 || (n < 0 && errno == EINTR)))
+		if(n > 0)
+			err = write_all(out, buf, n);
+	if(err == 0 && n < 0)
+		err = errno;
+	free(buf);
+	return err;
+}
+
+/**
+ * Copy in to out until EOF the cheapest way both allow. Every method moves
+ * the file offsets, so a refused one can hand over to the next midway
+ * @param  in  source
+ * @param  out destination
+ * @return     0 or an errno value
+ */
+static int plumb_copy(int in, int out){
+	struct stat si, so;
+	if(fstat(in, &si) == -1 || fstat(out, &so) == -1)
+		return errno;
+	ssize_t n;
+	//an empty looking regular file may be /proc or sysfs, which only read() fills
+	if(S_ISREG(si.st_mode) && si.st_size > 0 && S_ISREG(so.st_mode)){
+		while((n = copy_file_range(in, NULL, out, NULL, PLUMB_CHUNK, 0)) > 0 || (n < 0 && errno == EINTR))
+			;
+		if(n == 0)
+			return 0;
+		if(!plumb_unsupported(errno))
+			return errno;
+	}
+	if(S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode)){
+		while((n = splice(in, NULL, out, NULL, PLUMB_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0
+				|| (n < 0 && errno == EINTR))
+			;
+		if(n == 0)
+			return 0;
+		if(!plumb_unsupported(errno))
+			return errno;
+	}
+	return plumb_read_write(in, out);
+}
+
+/**
+ * Move n bytes out of a pipe of ours into fd, with read/write if splice
+ * can't write there (a terminal, an O_APPEND file)
+ * @return 0 or an errno value
+ */
+static int pipe_drain(int pipe_fd, int fd, size_t n, char *buf){
+	while(n > 0){
+		ssize_t m = splice(pipe_fd, NULL, fd, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(m < 0 && errno == EINTR)
+			continue;
+		if(m < 0 && !plumb_unsupported(errno))
+			return errno;
+		if(m < 0){
+			m = read(pipe_fd, buf, n < PLUMB_PIPE_SIZE ? n : PLUMB_PIPE_SIZE);
+			if(m <= 0)
+				return m < 0 ? errno : EIO;
+			int err = write_all(fd, buf, m);
+			if(err != 0)
+				return err;
+		}
+		n -= m;
+	}
+	return 0;
+}
+
+static bool cat_handles(struct command_t *command){
+	for(int i = 0; i < command->arg_count; i++)
+		if(command->args[i][0] == '-' && command->args[i][1] != '\0' && strcmp(command->args[i], "-u") != 0)
+			return false;
+	return true;
+}
+
+//cat [-u] [file|-]...: -u is what it does anyway
+static int cat_builtin(struct command_t *command, int in_fd, int out_fd){
+	int status = 0, files = 0;
+	struct stat so;
+	bool out_regular = fstat(out_fd, &so) == 0 && S_ISREG(so.st_mode);
+	plumb_grow(out_fd);
+	for(int i = 0; i <= command->arg_count; i++){
+		const char *name = i < command->arg_count ? command->args[i] : "-";
+		if(i < command->arg_count && strcmp(name, "-u") == 0)
+			continue;
+		if(i == command->arg_count && files > 0)
+			break; // stdin only when no file was named
+		files++;
+		int fd = strcmp(name, "-") == 0 ? in_fd : open(name, O_RDONLY | O_CLOEXEC);
+		if(fd < 0){
+			fprintf(stderr, "-%s: cat: %s: %s\n", sysname, name, strerror(errno));
+			status = 1;
+			continue;
+		}
+		struct stat si;
+		int err = 0;
+		if(out_regular && fstat(fd, &si) == 0 && si.st_dev == so.st_dev && si.st_ino == so.st_ino){
+			fprintf(stderr, "-%s: cat: %s: input file is output file\n", sysname, name);
+			status = 1;
+		} else {
+			if(fd == in_fd)
+				plumb_grow(fd);
+			err = plumb_copy(fd, out_fd);
+		}
+		if(fd != in_fd)
+			close(fd);
+		if(err == EPIPE)
+			return 1; // the reader is gone, as for sort and uniq
+		if(err != 0){
+			fprintf(stderr, "-%s: cat: %s: %s\n", sysname, name, strerror(err));
+			status = 1;
+		}
+	}
+	return status;
+}
+
+static bool tee_handles(struct command_t *command){
+	for(int i = 0; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1] != '\0'; i++){
+		if(strcmp(command->args[i], "--") == 0)
+			break;
+		if(command->args[i][strspn(command->args[i] + 1, "a") + 1] != '\0')
+			return false;
+	}
+	return true;
+}
+
+//A file tee can't write to is reported and dropped, the others go on
+static void tee_result(int *fds, const char **names, int i, int err, int *status){
+	if(err == 0 || fds[i] < 0)
+		return;
+	fprintf(stderr, "-%s: tee: %s: %s\n", sysname, names[i], strerror(err));
+	close(fds[i]);
+	fds[i] = -1;
+	*status = 1;
+}
+
+/**
+ * The zero copy loop of tee: each chunk is spliced from in into a pipe p of
+ * ours, tee(2) copies p's buffers into the empty pipe q once per file and q
+ * is spliced to it, then p itself is spliced to out
+ * @param  in     source
+ * @param  out    stdout of tee
+ * @param  fds    the files, -1 for ones that failed
+ * @param  names  their names
+ * @param  count  how many
+ * @param  status set to 1 when a file fails
+ * @return        0, an errno value for in or out, or EOPNOTSUPP before
+ *                anything was read if in can't be spliced
+ */
+static int tee_splice(int in, int out, int *fds, const char **names, int count, int *status){
+	int p[2], q[2];
+	if(pipe2(p, O_CLOEXEC) == -1)
+		return errno;
+	if(pipe2(q, O_CLOEXEC) == -1){
+		close(p[0]);
+		close(p[1]);
+		return errno;
+	}
+	fcntl(p[1], F_SETPIPE_SZ, PLUMB_PIPE_SIZE);
+	size_t size = fcntl(p[1], F_GETPIPE_SZ);
+	fcntl(q[1], F_SETPIPE_SZ, size);
+	//an empty q as large as p takes all p holds, so each tee copies the whole chunk
+	bool fits = (size_t)fcntl(q[1], F_GETPIPE_SZ) >= size;
+	char *buf = malloc(size);
+	int err = 0;
+	bool read_any = false;
+	while(err == 0){
+		ssize_t n = splice(in, NULL, p[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			err = !read_any && plumb_unsupported(errno) ? EOPNOTSUPP : errno;
+		if(n <= 0)
+			break;
+		read_any = true;
+		ssize_t t = n;
+		int i = 0;
+		for(; i < count; i++){
+			if(fds[i] < 0)
+				continue;
+			t = fits ? tee(p[0], q[1], n, 0) : -1;
+			if(t > 0)
+				tee_result(fds, names, i, pipe_drain(q[0], fds[i], t, buf), status);
+			if(t != n)
+				break;
+		}
+		if(i == count){
+			err = pipe_drain(p[0], out, n, buf);
+			continue;
+		}
+		//q took less than p holds: the rest of this chunk goes through memory
+		size_t have = 0;
+		while(have < (size_t)n){
+			ssize_t m = read(p[0], buf + have, n - have);
+			if(m <= 0)
+				break;
+			have += m;
+		}
+		size_t skip = t > 0 ? t : 0;
+		for(; i < count; i++, skip = 0)
+			if(fds[i] >= 0)
+				tee_result(fds, names, i, write_all(fds[i], buf + skip, have - skip), status);
+		err = write_all(out, buf, have);
+	}
+	free(buf);
+	close(p[0]);
+	close(p[1]);
+	close(q[0]);
+	close(q[1]);
+	return err;
+}
+
+static int tee_read_write(int in, int out, int *fds, const char **names, int count, int *status){
+	char *buf = malloc(PLUMB_BUF_SIZE);
+	int err = 0;
+	ssize_t n;
+	while(err == 0 && ((n = read(in, buf, PLUMB_BUF_SIZE)) > 0 || (n < 0 && errno == EINTR))){
+		if(n < 0)
+			continue;
+		for(int i = 0; i < count; i++)
+			if(fds[i] >= 0)
+				tee_result(fds, names, i, write_all(fds[i], buf, n), status);
+		err = write_all(out, buf, n);
+	}
+	if(err == 0 && n < 0)
+		err = errno;
+	free(buf);
+	return err;
+}
+
+//tee [-a] [file]...
+static int tee_builtin(struct command_t *command, int in_fd, int out_fd){
+	bool append = false;
+	int first = 0, status = 0;
+	for(; first < command->arg_count && command->args[first][0] == '-' && command->args[first][1] != '\0'; first++){
+		if(strcmp(command->args[first], "--") == 0){
+			first++;
+			break;
+		}
+		append = true; // tee_handles only lets -a through
+	}
+	int count = command->arg_count - first;
+	const char **names = (const char **)command->args + first;
+	int *fds = malloc(sizeof(int) * (count > 0 ? count : 1));
+	for(int i = 0; i < count; i++){
+		fds[i] = open(names[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+		if(fds[i] < 0){
+			fprintf(stderr, "-%s: tee: %s: %s\n", sysname, names[i], strerror(errno));
+			status = 1;
+		}
+	}
+	plumb_grow(in_fd);
+	plumb_grow(out_fd);
+	int err = tee_splice(in_fd, out_fd, fds, names, count, &status);
+	if(err == EOPNOTSUPP)
+		err = tee_read_write(in_fd, out_fd, fds, names, count, &status);
+	for(int i = 0; i < count; i++)
+		if(fds[i] >= 0)
+			close(fds[i]);
+	free(fds);
+	if(err != 0 && err != EPIPE) // a reader that went away ends it quietly
+		fprintf(stderr, "-%s: tee: %s\n", sysname, strerror(err));
+	return err != 0 ? 1 : status;
+}
+
+//SCRIPT CACHE: `shellax --cache script` keeps the parsed pipelines of a script
+//next to it in .name.shxc. The file is one relocatable blob: pointers are
+//stored as offsets from its start and listed in a relocation table, so a
+//later run maps it and adds the base address instead of lexing and allocating.
+#define SCRIPT_CACHE_MAGIC "SHXCACHE"
+#define SCRIPT_CACHE_VERSION 2
+
+struct script_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t command_size; // sizeof(struct command_t) of the writer
+	int64_t mtime_sec, mtime_nsec; // of the script the blob was built from
+	uint64_t script_size;
+	uint64_t script_hash;
+	uint64_t line_count; // non-empty lines, pointers to their commands at lines_offset
+	uint64_t lines_offset;
+	uint64_t reloc_count; // offsets of every pointer slot, at reloc_offset
+	uint64_t reloc_offset;
+	uint64_t size; // of the whole blob
+};
+
+struct sc_writer {
+	char *buf;
+	size_t len, cap;
+	uint64_t *relocs;
+	size_t reloc_count, reloc_cap;
+};
+
+//Zeroed, 8 byte aligned space in the blob
+static size_t sc_reserve(struct sc_writer *w, size_t n){
+	size_t off = (w->len + 7) & ~(size_t)7;
+	if(off + n > w->cap){
+		while(off + n > w->cap)
+			w->cap = w->cap ? w->cap * 2 : 4096;
+		w->buf = realloc(w->buf, w->cap);
+	}
+	memset(w->buf + w->len, 0, off + n - w->len);
+	w->len = off + n;
+	return off;
+}
+
+static size_t sc_string(struct sc_writer *w, const char *s){
+	size_t len = strlen(s);
+	size_t off = sc_reserve(w, len + 1);
+	memcpy(w->buf + off, s, len + 1);
+	return off;
+}
+
+//Make the pointer slot at offset slot point at offset target
+static void sc_pointer(struct sc_writer *w, size_t slot, size_t target){
+	uintptr_t value = target;
+	memcpy(w->buf + slot, &value, sizeof(value));
+	if(w->reloc_count == w->reloc_cap){
+		w->reloc_cap = w->reloc_cap ? w->reloc_cap * 2 : 256;
+		w->relocs = realloc(w->relocs, w->reloc_cap * sizeof(uint64_t));
+	}
+	w->relocs[w->reloc_count++] = slot;
+}
+
+//Serialize a command and the rest of its pipeline, returns its offset
+static size_t sc_command(struct sc_writer *w, struct command_t *command){
+	size_t off = sc_reserve(w, sizeof(struct command_t));
+	struct command_t copy = *command;
+	copy.name = NULL;
+	copy.args = copy.argv = NULL;
+	copy.redirects = NULL;
+	copy.next = NULL;
+	memcpy(w->buf + off, &copy, sizeof(copy));
+
+	size_t argv = sc_reserve(w, sizeof(char *) * (command->arg_count + 2)); // NULL terminated by sc_reserve
+	size_t name = sc_string(w, command->name);
+	sc_pointer(w, off + offsetof(struct command_t, name), name);
+	sc_pointer(w, off + offsetof(struct command_t, argv), argv);
+	sc_pointer(w, off + offsetof(struct command_t, args), argv + sizeof(char *));
+	sc_pointer(w, argv, name);
+	for(int i = 0; i < command->arg_count; i++)
+		sc_pointer(w, argv + sizeof(char *) * (i + 1), sc_string(w, command->args[i]));
+	if(command->redirect_count > 0){
+		size_t redirects = sc_reserve(w, sizeof(struct redirect) * command->redirect_count);
+		sc_pointer(w, off + offsetof(struct command_t, redirects), redirects);
+		for(int i = 0; i < command->redirect_count; i++){
+			size_t r = redirects + sizeof(struct redirect) * i;
+			memcpy(w->buf + r + offsetof(struct redirect, op), &command->redirects[i].op, sizeof(enum redirect_op));
+			if(command->redirects[i].target != NULL)
+				sc_pointer(w, r + offsetof(struct redirect, target), sc_string(w, command->redirects[i].target));
+		}
+	}
+	if(command->next != NULL)
+		sc_pointer(w, off + offsetof(struct command_t, next), sc_command(w, command->next));
+	return off;
+}
+
+/**
+ * Parse every line of a script into a blob, pointers still as offsets
+ * @param  script contents
+ * @param  len    their length
+ * @param  st     stat of the script, recorded for invalidation
+ * @param  hash   content hash, recorded for invalidation
+ * @return        malloc'd blob starting with its header
+ */
+static char *script_cache_compile(const char *script, size_t len, struct stat *st, uint64_t hash){
+	struct sc_writer w = {0};
+	size_t *roots = NULL, count = 0, cap = 0;
+	sc_reserve(&w, sizeof(struct script_cache_header));
+
+	const char *p = script, *end = script + len;
+	while(p < end){
+		const char *nl = memchr(p, '\n', end - p);
+		size_t line_len = nl ? (size_t)(nl - p) : (size_t)(end - p);
+		struct command_t *command = alloc_command();
+		parse_command(arena_strndup(&command_arena, p, line_len), command);
+		if(command->name[0] != '\0'){ // blank and comment lines do nothing
+			if(count == cap){
+				cap = cap ? cap * 2 : 64;
+				roots = realloc(roots, cap * sizeof(size_t));
+			}
+			roots[count++] = sc_command(&w, command);
+		}
+		free_command(command);
+		p += line_len + 1;
+	}
+
+	size_t lines = sc_reserve(&w, sizeof(char *) * count);
+	for(size_t i = 0; i < count; i++)
+		sc_pointer(&w, lines + sizeof(char *) * i, roots[i]);
+	size_t relocs = sc_reserve(&w, sizeof(uint64_t) * w.reloc_count);
+	memcpy(w.buf + relocs, w.relocs, sizeof(uint64_t) * w.reloc_count);
+
+	struct script_cache_header *h = (struct script_cache_header *)w.buf;
+	memcpy(h->magic, SCRIPT_CACHE_MAGIC, sizeof(h->magic));
+	h->version = SCRIPT_CACHE_VERSION;
+	h->command_size = sizeof(struct command_t);
+	h->mtime_sec = st->st_mtim.tv_sec;
+	h->mtime_nsec = st->st_mtim.tv_nsec;
+	h->script_size = st->st_size;
+	h->script_hash = hash;
+	h->line_count = count;
+	h->lines_offset = lines;
+	h->reloc_count = w.reloc_count;
+	h->reloc_offset = relocs;
+	h->size = w.len;
+	free(roots);
+	free(w.relocs);
+	return w.buf;
+}
+
+/**
+ * Turn the stored offsets into pointers for a blob loaded at base
+ * @param  base blob
+ * @param  size its length, every slot and target is checked against it
+ * @return      false if the blob is malformed
+ */
+static bool script_cache_relocate(char *base, size_t size){
+	struct script_cache_header *h = (struct script_cache_header *)base;
+	if(h->reloc_offset > size || h->reloc_count > (size - h->reloc_offset) / sizeof(uint64_t)
+			|| h->lines_offset > size || h->line_count > (size - h->lines_offset) / sizeof(char *))
+		return false;
+	const uint64_t *relocs = (const uint64_t *)(base + h->reloc_offset);
+	for(uint64_t i = 0; i < h->reloc_count; i++){
+		uintptr_t value;
+		if(relocs[i] > size - sizeof(value))
+			return false;
+		memcpy(&value, base + relocs[i], sizeof(value));
+		if(value >= size)
+			return false;
+		value += (uintptr_t)base;
+		memcpy(base + relocs[i], &value, sizeof(value));
+	}
+	return true;
+}
+
+//n bytes at p lie inside the blob
+static bool sc_inside(const char *base, size_t size, const void *p, size_t n){
+	const char *c = p;
+	return c >= base && (size_t)(c - base) <= size && n <= size - (size_t)(c - base);
+}
+
+static bool sc_string_ok(const char *base, size_t size, const char *s){
+	return s != NULL && sc_inside(base, size, s, 0) && memchr(s, '\0', base + size - s) != NULL;
+}
+
+/**
+ * Check every command of a relocated blob before it is run: pointers land
+ * inside it, counts fit the arrays they describe and strings end in it, so
+ * a corrupt cache with a valid header can't send us out of bounds
+ * @param  base relocated blob
+ * @param  size its length
+ * @return      false if anything is off
+ */
+static bool script_cache_check(const char *base, size_t size){
+	const struct script_cache_header *h = (const struct script_cache_header *)base;
+	struct command_t *const *lines = (struct command_t *const *)(base + h->lines_offset);
+	size_t budget = size / sizeof(struct command_t); // more stages than fit means a cycle
+	for(uint64_t i = 0; i < h->line_count; i++){
+		for(const struct command_t *c = lines[i]; c != NULL; c = c->next){
+			if(budget-- == 0 || !sc_inside(base, size, c, sizeof(*c)) || c->arg_count < 0
+					|| (size_t)c->arg_count > size / sizeof(char *) - 2
+					|| !sc_inside(base, size, c->argv, sizeof(char *) * (c->arg_count + 2))
+					|| c->args != c->argv + 1 || c->argv[0] != c->name || c->argv[c->arg_count + 1] != NULL
+					|| !sc_string_ok(base, size, c->name) || c->redirect_count < 0
+					|| (size_t)c->redirect_count > size / sizeof(struct redirect)
+					|| (c->redirect_count > 0
+						&& !sc_inside(base, size, c->redirects, sizeof(struct redirect) * c->redirect_count)))
+				return false;
+			for(int j = 1; j <= c->arg_count; j++)
+				if(!sc_string_ok(base, size, c->argv[j]))
+					return false;
+			for(int j = 0; j < c->redirect_count; j++){
+				const struct redirect *r = &c->redirects[j];
+				if((unsigned)r->op > REDIRECT_ALL_APPEND || (r->op == REDIRECT_ERR_TO_OUT) != (r->target == NULL)
+						|| (r->target != NULL && !sc_string_ok(base, size, r->target)))
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+/**
+ * Map a cache file if it was built from this exact script
+ * @param  cache_path path of the cache
+ * @param  st         stat of the script
+ * @param  hash       content hash of the script
+ * @param  size       set to the mapping's length
+ * @return            the relocated blob, or NULL if missing or stale
+ */
+static char *script_cache_load(const char *cache_path, struct stat *st, uint64_t hash, size_t *size){
+	struct stat cst;
+	int fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return NULL;
+	if(fstat(fd, &cst) == -1 || cst.st_size < (off_t)sizeof(struct script_cache_header)){
+		close(fd);
+		return NULL;
+	}
+	*size = cst.st_size;
+	// private and writable: relocation dirties our copy of the pages, never the file
+	char *base = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(base == MAP_FAILED)
+		return NULL;
+	struct script_cache_header *h = (struct script_cache_header *)base;
+	if(memcmp(h->magic, SCRIPT_CACHE_MAGIC, sizeof(h->magic)) != 0
+			|| h->version != SCRIPT_CACHE_VERSION || h->command_size != sizeof(struct command_t)
+			|| h->size != *size || h->script_size != (uint64_t)st->st_size
+			|| h->mtime_sec != st->st_mtim.tv_sec || h->mtime_nsec != st->st_mtim.tv_nsec
+			|| h->script_hash != hash || !script_cache_relocate(base, *size)
+			|| !script_cache_check(base, *size)){
+		munmap(base, *size);
+		return NULL;
+	}
+	return base;
+}
+
+//Write through a temporary file so readers never see a partial cache
+static void script_cache_store(const char *cache_path, const char *blob, size_t size){
+	char tmp[PATH_MAX];
+	if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache_path) >= (int)sizeof(tmp))
+		return;
+	int fd = mkstemp(tmp);
+	if(fd == -1)
+		return; // no cache if the directory isn't writable, just parse every time
+	bool ok = true;
+	for(size_t done = 0; ok && done < size; ){
+		ssize_t r = write(fd, blob + done, size - done);
+		if(r < 0 && errno == EINTR) continue;
+		ok = r > 0;
+		done += ok ? r : 0;
+	}
+	close(fd);
+	if(!ok || rename(tmp, cache_path) == -1)
+		unlink(tmp);
+}
+
+//Content hash for invalidation, 8 bytes per step since it runs on every start
+static uint64_t script_cache_hash(const char *p, size_t len){
+	uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	for(; len >= 8; p += 8, len -= 8){
+		uint64_t word;
+		memcpy(&word, p, 8);
+		h = (h ^ word) * 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	uint64_t tail = 0;
+	if(len > 0)
+		memcpy(&tail, p, len);
+	h = (h ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+	return h ^ (h >> 29);
+}
+
+/**
+ * Run a script from its cache, building the cache first if it is missing or
+ * the script changed since (mtime, size and a hash of the contents)
+ * @param  path script
+ * @return      EXIT if the script ran exit, SUCCESS otherwise, UNKNOWN if
+ *              the script can't be read
+ */
+int run_script_cached(const char *path){
+	struct stat st;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1 || fstat(fd, &st) == -1){
+		printf("-%s: %s: %s\n", sysname, path, strerror(errno));
+		if(fd != -1) close(fd);
+		last_status = 127;
+		return UNKNOWN;
+	}
+	char *script = NULL;
+	if(st.st_size > 0){
+		script = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(script == MAP_FAILED){
+			printf("-%s: %s: %s\n", sysname, path, strerror(errno));
+			close(fd);
+			last_status = 127;
+			return UNKNOWN;
+		}
+	}
+	close(fd);
+	uint64_t hash = script_cache_hash(script, st.st_size);
+
+	char cache_path[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+	int dir_len = slash ? slash - path + 1 : 0;
+	snprintf(cache_path, sizeof(cache_path), "%.*s.%s.shxc", dir_len, path, path + dir_len);
+
+	size_t size;
+	bool mapped = true;
+	char *base = script_cache_load(cache_path, &st, hash, &size);
+	if(base == NULL){
+		mapped = false;
+		base = script_cache_compile(script, st.st_size, &st, hash);
+		size = ((struct script_cache_header *)base)->size;
+		script_cache_store(cache_path, base, size);
+		script_cache_relocate(base, size);
+	}
+	if(script != NULL)
+		munmap(script, st.st_size);
+
+	struct script_cache_header *h = (struct script_cache_header *)base;
+	struct command_t **lines = (struct command_t **)(base + h->lines_offset);
+	int code = SUCCESS;
+	for(uint64_t i = 0; i < h->line_count && code != EXIT; i++){
+		job_notify(); // as run_line does, background jobs don't pile up as zombies
+		code = process_command(lines[i]);
+	}
+
+	if(mapped)
+		munmap(base, size);
+	else
+		free(base);
+	return code;
+}
+
+//IO REDIRECTION: a stage's redirections are opened left to right with
+//O_CLOEXEC into the fds its 0, 1 and 2 should become; no data is read or
+//buffered. A child gets them with dup2 as it starts, a thread stage as its
+//in and out fds, and a builtin run by the shell itself has them swapped in
+//for the shell's own fds 0-2 around the call.
+
+//Make fd the stage's target fd, closing what the slot held if it was ours
+static void redirect_set(struct redirection *rd, int target, int fd){
+	if(rd->owned[target])
+		close(rd->fd[target]);
+	rd->fd[target] = fd;
+	rd->owned[target] = true;
+}
+
+static void redirect_close(struct redirection *rd){
+	for(int i = 0; i < 3; i++){
+		if(rd->owned[i])
+			close(rd->fd[i]);
+		rd->owned[i] = false;
+	}
+}
+
+/**
+ * Open a stage's redirections on top of its pipe ends. 2>&1 takes a copy
+ * of whatever fd 1 is at that point, so `> f 2>&1` and `2>&1 > f` differ
+ * the way they do in sh
+ * @param  command the stage
+ * @param  in_fd   its pipe input, -1 for the shell's stdin; rd owns it from now on
+ * @param  out_fd  its pipe output, -1 for the shell's stdout; rd owns it from now on
+ * @param  rd      filled with the fds to install
+ * @return         SUCCESS, or EXIT with everything closed if one can't be opened
+ */
+int io_redirect(struct command_t *command, int in_fd, int out_fd, struct redirection *rd){
+	rd->fd[0] = in_fd >= 0 ? in_fd : STDIN_FILENO;
+	rd->fd[1] = out_fd >= 0 ? out_fd : STDOUT_FILENO;
+	rd->fd[2] = STDERR_FILENO;
+	rd->owned[0] = in_fd >= 0;
+	rd->owned[1] = out_fd >= 0;
+	rd->owned[2] = false;
+	for(int i = 0; i < command->redirect_count; i++){
+		struct redirect *r = &command->redirects[i];
+		int target = redirect_ops[r->op].fd;
+		int fd = r->target != NULL ? open(r->target, redirect_ops[r->op].flags | O_CLOEXEC, 0644)
+			: fcntl(rd->fd[STDOUT_FILENO], F_DUPFD_CLOEXEC, 3);
+		if(fd >= 0)
+			redirect_set(rd, target, fd);
+		if(fd >= 0 && (r->op == REDIRECT_ALL || r->op == REDIRECT_ALL_APPEND)){
+			fd = fcntl(rd->fd[STDOUT_FILENO], F_DUPFD_CLOEXEC, 3);
+			if(fd >= 0)
+				redirect_set(rd, STDERR_FILENO, fd);
+		}
+		if(fd < 0){
+			printf("-%s: %s: %s\n", sysname, r->target ? r->target : redirect_ops[r->op].text, strerror(errno));
+			redirect_close(rd);
+			return EXIT;
+		}
+	}
+	return SUCCESS;
+}
+
+/**
+ * Install a builtin's redirections over the shell's own fds 0-2 while it
+ * runs in the shell, keeping copies of what was there
+ * @param rd    from io_redirect
+ * @param saved set to the copies, -1 for fds left alone
+ */
+static void redirect_save(struct redirection *rd, int saved[3]){
+	fflush(stdout);
+	for(int i = 0; i < 3; i++){
+		saved[i] = -1;
+		if(rd->fd[i] == i)
+			continue;
+		saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+		dup2(rd->fd[i], i);
+	}
+}
+
+static void redirect_restore(int saved[3]){
+	fflush(stdout);
+	fflush(stderr);
+	for(int i = 0; i < 3; i++){
+		if(saved[i] < 0)
+			continue;
+		dup2(saved[i], i);
+		close(saved[i]);
+	}
+}
+
+
+//PATH LOOKUP CACHE
+#define PATH_CACHE_BUCKETS 256
+#define PATH_CACHE_RECHECK_NS 1000000000L // revalidate PATH directories at most once a second
+#define DEFAULT_PATH "/usr/local/bin:/usr/bin:/bin:/usr/games"
+
+struct path_dir {
+	char *dir;
+	struct timespec mtime;
+	bool relative; // e.g. "." or an empty PATH entry, meaning changes with cd
+};
+
+struct path_cache_entry {
+	char *name;
+	char *path; // NULL for a cached miss
+	int dir_index; // which PATH directory the hit came from
+	unsigned hits;
+	struct path_cache_entry *next;
+};
+
+static struct path_cache_entry *path_cache[PATH_CACHE_BUCKETS];
+static char *path_cache_env; // PATH value the cache was built for
+static struct path_dir *path_dirs;
+static int path_dir_count;
+static bool path_has_relative;
+static struct timespec path_cache_checked;
+static unsigned path_generation; // bumped whenever PATH or one of its directories changes
+
+static unsigned path_hash(const char *s){
+	unsigned h = 2166136261u; //FNV-1a
+	while(*s){
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return h % PATH_CACHE_BUCKETS;
+}
+
+/**
+ * Drop cached hits found in PATH directory from_index or later (an earlier
+ * directory may now shadow them) together with every cached miss
+ * @param from_index first PATH directory that changed
+ */
+static void path_cache_drop(int from_index){
+	for(int b = 0; b < PATH_CACHE_BUCKETS; b++){
+		struct path_cache_entry **pe = &path_cache[b];
+		while(*pe){
+			struct path_cache_entry *e = *pe;
+			if(e->path == NULL || e->dir_index >= from_index){
+				*pe = e->next;
+				free(e->name);
+				free(e->path);
+				free(e);
+			} else {
+				pe = &e->next;
+			}
+		}
+	}
+}
+
+static void path_dir_stat(struct path_dir *d, struct timespec *mtime){
+	struct stat st;
+	if(stat(d->dir, &st) == 0){
+		*mtime = st.st_mtim;
+	} else {
+		mtime->tv_sec = -1; //missing directory
+		mtime->tv_nsec = 0;
+	}
+}
+
+static void path_cache_load_dirs(const char *env){
+	for(int i = 0; i < path_dir_count; i++)
+		free(path_dirs[i].dir);
+	free(path_dirs);
+	free(path_cache_env);
+	path_cache_env = strdup(env);
+	path_generation++;
+
+	path_dir_count = 1;
+	for(const char *c = env; *c; c++)
+		if(*c == ':') path_dir_count++;
+	path_dirs = calloc(path_dir_count, sizeof(struct path_dir));
+	path_has_relative = false;
+
+	const char *start = env;
+	for(int i = 0; i < path_dir_count; i++){
+		const char *end = strchr(start, ':');
+		size_t len = end ? (size_t)(end - start) : strlen(start);
+		if(len == 0){ //empty entry means current directory
+			path_dirs[i].dir = strdup(".");
+		} else {
+			path_dirs[i].dir = strndup(start, len);
+		}
+		path_dirs[i].relative = path_dirs[i].dir[0] != '/';
+		if(path_dirs[i].relative)
+			path_has_relative = true;
+		path_dir_stat(&path_dirs[i], &path_dirs[i].mtime);
+		start = end ? end + 1 : start + len;
+	}
+}
+
+/**
+ * Make sure the cache still matches PATH and the directories in it.
+ * Directory mtimes are only rechecked once per PATH_CACHE_RECHECK_NS so a
+ * burst of commands costs no stat calls.
+ */
+static void path_cache_validate(void){
+	const char *env = getenv("PATH");
+	if(env == NULL) env = DEFAULT_PATH;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(path_cache_env == NULL || strcmp(env, path_cache_env) != 0){ //PATH changed
+		path_cache_drop(0);
+		path_cache_load_dirs(env);
+		path_cache_checked = now;
+		return;
+	}
+	long elapsed = (now.tv_sec - path_cache_checked.tv_sec) * 1000000000L
+		+ (now.tv_nsec - path_cache_checked.tv_nsec);
+	if(elapsed < PATH_CACHE_RECHECK_NS) return;
+	path_cache_checked = now;
+
+	for(int i = 0; i < path_dir_count; i++){
+		struct timespec mtime;
+		path_dir_stat(&path_dirs[i], &mtime);
+		if(mtime.tv_sec != path_dirs[i].mtime.tv_sec || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec){
+			path_cache_drop(i);
+			path_generation++;
+			for(int j = i; j < path_dir_count; j++)
+				path_dir_stat(&path_dirs[j], &path_dirs[j].mtime);
+			break;
+		}
+	}
+}
+
+/**
+ * Resolve a command name to an executable path by walking PATH.
+ * Results (including misses) are cached until PATH or one of its
+ * directories changes.
+ * @param  name command name
+ * @return      path to execute, NULL if not found
+ */
+char *path_lookup(const char *name){
+	static char found[PATH_MAX];
+	if(strchr(name, '/') != NULL) //explicit path, no lookup
+		return access(name, X_OK) == 0 ? (char *)name : NULL;
+
+	path_cache_validate();
+	unsigned b = path_hash(name);
+	for(struct path_cache_entry *e = path_cache[b]; e; e = e->next){
+		if(strcmp(e->name, name) == 0){
+			e->hits++;
+			return e->path;
+		}
+	}
+
+	int dir_index = -1;
+	struct stat st;
+	for(int i = 0; i < path_dir_count; i++){
+		snprintf(found, sizeof(found), "%s/%s", path_dirs[i].dir, name);
+		if(stat(found, &st) == 0 && S_ISREG(st.st_mode) && access(found, X_OK) == 0){
+			dir_index = i;
+			break;
+		}
+	}
+	if(dir_index >= 0 && path_dirs[dir_index].relative)
+		return found; //depends on the working directory, don't cache
+	if(dir_index < 0 && path_has_relative)
+		return NULL; //a cd could make it appear
+
+	struct path_cache_entry *e = malloc(sizeof(struct path_cache_entry));
+	e->name = strdup(name);
+	e->path = dir_index >= 0 ? strdup(found) : NULL;
+	e->dir_index = dir_index;
+	e->hits = 1;
+	e->next = path_cache[b];
+	path_cache[b] = e;
+	return e->path;
+}
+
+//HASH BUILTIN: list (no args), clear (-r) or add names to the lookup cache
+int hash_builtin(struct command_t *command, int in_fd, int out_fd){
+	if(command->arg_count > 0 && strcmp(command->args[0], "-r") == 0){
+		path_cache_drop(0);
+		return SUCCESS;
+	}
+	if(command->arg_count > 0){
+		for(int i = 0; i < command->arg_count; i++){
+			if(path_lookup(command->args[i]) == NULL)
+				printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+		}
+		return SUCCESS;
+	}
+	bool any = false;
+	for(int b = 0; b < PATH_CACHE_BUCKETS; b++){
+		for(struct path_cache_entry *e = path_cache[b]; e; e = e->next){
+			if(e->path == NULL) continue;
+			if(!any) printf("hits\tcommand\n");
+			any = true;
+			printf("%4u\t%s\n", e->hits, e->path);
+		}
+	}
+	if(!any)
+		printf("%s: hash table empty\n", sysname);
+	return SUCCESS;
+}
+
+//BUILTIN TABLE: every builtin with how it may be run, looked up through a
+//perfect hash so dispatch is one hash and one strcmp
+#define BUILTIN_FDS 1 // reads in_fd and writes out_fd itself: runs in-process, as a thread inside a pipeline
+#define BUILTIN_SHELL 2 // changes the shell's own state: alone it runs in the shell, in a pipeline in a child
+#define BUILTIN_FORK 4 // interactive, always runs in a child that owns the terminal
+#define BUILTIN_TABLE_SIZE 32 // power of two
+
+struct builtin {
+	const char *name;
+	int (*run)(struct command_t *command, int in_fd, int out_fd); // returns an exit status
+	int flags;
+	bool (*handles)(struct command_t *command); // NULL for any arguments, false runs the PATH command
+	bool (*reads_stdin)(struct command_t *command); // BUILTIN_FDS only, NULL if it always does
+};
+
+static bool shell_exiting; // set by exit, checked by process_command
+
+static int builtin_exit(struct command_t *command, int in_fd, int out_fd){
+	shell_exiting = true;
+	return command->arg_count > 0 ? atoi(command->args[0]) : last_status;
+}
+
+static int builtin_cd(struct command_t *command, int in_fd, int out_fd){
+	const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+	if(dir == NULL)
+		return 0;
+	if(chdir(dir) == -1){
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+static int builtin_uniq(struct command_t *command, int in_fd, int out_fd){
+	return myuniq(command, in_fd, out_fd) == SUCCESS ? 0 : 1;
+}
+
+static int builtin_sort(struct command_t *command, int in_fd, int out_fd){
+	return mysort(command, in_fd, out_fd) == SUCCESS ? 0 : 1;
+}
+
+static int builtin_wiseman(struct command_t *command, int in_fd, int out_fd){
+	wiseman(command);
+	return 0;
+}
+
+static int builtin_rps(struct command_t *command, int in_fd, int out_fd){
+	rps(command);
+	return 0;
+}
+
+static int builtin_guess(struct command_t *command, int in_fd, int out_fd){
+	guessTheNumber(command);
+	return 0;
+}
+
+static int builtin_chatroom(struct command_t *command, int in_fd, int out_fd){
+	return chatroom(command) == SUCCESS ? 0 : 1;
+}
+
+/**
+ * Whether the operands leave a command reading stdin: none, or one is "-"
+ * @param  command    the command
+ * @param  with_value options whose value is the next argument, NULL terminated
+ * @return            true if stdin is read
+ */
+static bool operands_read_stdin(struct command_t *command, const char *const *with_value){
+	bool operand = false;
+	for(int i = 0; i < command->arg_count; i++){
+		const char *arg = command->args[i];
+		if(strcmp(arg, "-") == 0)
+			return true;
+		if(arg[0] != '-'){
+			operand = true;
+			continue;
+		}
+		for(const char *const *v = with_value; *v != NULL; v++)
+			if(strcmp(arg, *v) == 0)
+				i++;
+	}
+	return !operand;
+}
+
+static bool uniq_reads_stdin(struct command_t *command){
+	static const char *const with_value[] = { "-j", "--max-memory", NULL };
+	return operands_read_stdin(command, with_value);
+}
+
+static bool sort_reads_stdin(struct command_t *command){
+	static const char *const with_value[] = { "-k", "-S", NULL };
+	return operands_read_stdin(command, with_value);
+}
+
+static bool cat_reads_stdin(struct command_t *command){
+	static const char *const with_value[] = { NULL };
+	return operands_read_stdin(command, with_value);
+}
+
+static const struct builtin builtins[] = {
+	{ "cd", builtin_cd, BUILTIN_SHELL },
+	{ "exit", builtin_exit, BUILTIN_SHELL },
+	{ "set", set_builtin, BUILTIN_SHELL },
+	{ "hash", hash_builtin, BUILTIN_SHELL },
+	{ "jobs", jobs_builtin, BUILTIN_SHELL },
+	{ "fg", fg_builtin, BUILTIN_SHELL },
+	{ "bg", bg_builtin, BUILTIN_SHELL },
+	{ "wait", wait_builtin, BUILTIN_SHELL },
+	{ "kill", kill_builtin, BUILTIN_SHELL },
+	{ "trace", trace_builtin, BUILTIN_SHELL },
+	{ "uniq", builtin_uniq, BUILTIN_FDS, NULL, uniq_reads_stdin },
+	{ "sort", builtin_sort, BUILTIN_FDS, sort_handles, sort_reads_stdin },
+	{ "cat", cat_builtin, BUILTIN_FDS, cat_handles, cat_reads_stdin },
+	{ "tee", tee_builtin, BUILTIN_FDS, tee_handles },
+	{ "wiseman", builtin_wiseman, 0 },
+	{ "rps", builtin_rps, BUILTIN_FORK },
+	{ "guessthenumber", builtin_guess, BUILTIN_FORK },
+	{ "chatroom", builtin_chatroom, BUILTIN_FORK },
+};
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+static const struct builtin *builtin_slots[BUILTIN_TABLE_SIZE];
+static uint32_t builtin_seed; // 0 until the table is built
+
+static uint32_t builtin_hash(const char *name, uint32_t seed){
+	uint32_t h = 2166136261u ^ seed; //FNV-1a
+	while(*name){
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return (h ^ (h >> 15)) & (BUILTIN_TABLE_SIZE - 1);
+}
+
+//Try seeds until every name lands in its own slot
+static void builtin_table_init(){
+	for(uint32_t seed = 1; ; seed++){
+		bool clash = false;
+		memset(builtin_slots, 0, sizeof(builtin_slots));
+		for(size_t i = 0; i < BUILTIN_COUNT && !clash; i++){
+			const struct builtin **slot = &builtin_slots[builtin_hash(builtins[i].name, seed)];
+			clash = *slot != NULL;
+			*slot = &builtins[i];
+		}
+		if(!clash){
+			builtin_seed = seed;
+			return;
+		}
+	}
+}
+
+/**
+ * Find a builtin by name
+ * @param  name command name
+ * @return      its table entry, NULL if it isn't a builtin
+ */
+const struct builtin *builtin_lookup(const char *name){
+	if(builtin_seed == 0)
+		builtin_table_init();
+	const struct builtin *b = builtin_slots[builtin_hash(name, builtin_seed)];
+	return b != NULL && strcmp(b->name, name) == 0 ? b : NULL;
+}
+
+//The builtin to run a command with, NULL if its options are for the PATH command
+const struct builtin *builtin_find(struct command_t *command){
+	const struct builtin *b = builtin_lookup(command->name);
+	return b != NULL && b->handles != NULL && !b->handles(command) ? NULL : b;
+}
+
+/**
+ * Whether a lone command is run by the shell itself. One that would read
+ * the terminal goes to a child owning it instead, so ^C and ^Z reach it;
+ * one reading only files or a < redirect stays in the shell
+ * @param  b       from builtin_find
+ * @param  command the command
+ * @return         true to call b->run in the shell
+ */
+static bool builtin_in_shell(const struct builtin *b, struct command_t *command){
+	if(b == NULL || command->next != NULL || command->background || (b->flags & BUILTIN_FORK))
+		return false;
+	if(!(b->flags & BUILTIN_FDS) || !isatty(STDIN_FILENO))
+		return true;
+	if(b->reads_stdin != NULL && !b->reads_stdin(command))
+		return true;
+	for(int i = 0; i < command->redirect_count; i++)
+		if(command->redirects[i].op == REDIRECT_IN)
+			return true;
+	return false;
+}
+
+//TAB COMPLETION: the first word of a stage completes from a prefix trie of
+//builtins and PATH executables, rebuilt when PATH or one of its directories
+//changes; other words complete from cached, sorted directory listings that
+//are revalidated with one stat per Tab.
+#define COMPLETE_DIR_CACHE 8
+#define COMPLETE_STAT_LIMIT 64 // resolve symlinks to tell directories apart for at most this many matches
+
+//Siblings are kept sorted, so a depth-first walk yields names in order
+struct trie_node {
+	uint32_t child; // first child, 0 for none (the root is never a child)
+	uint32_t sibling;
+	char c;
+	bool terminal; // a name ends here
+};
+
+static struct {
+	struct trie_node *nodes;
+	uint32_t count, cap;
+	unsigned generation; // path_generation it was built for
+	bool built;
+} command_trie;
+
+struct dir_listing {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char **names; // sorted, each followed in memory by its d_type byte after the NUL
+	size_t count;
+	char *blob;
+	unsigned long used; // for replacement, higher is more recent
+};
+
+static struct dir_listing dir_listings[COMPLETE_DIR_CACHE];
+static unsigned long dir_listing_clock;
+static struct arena complete_arena; // results of the last completion
+
+static uint32_t trie_new_node(char c){
+	if(command_trie.count == command_trie.cap){
+		command_trie.cap = command_trie.cap ? command_trie.cap * 2 : 4096;
+		command_trie.nodes = realloc(command_trie.nodes, command_trie.cap * sizeof(struct trie_node));
+	}
+	command_trie.nodes[command_trie.count] = (struct trie_node){ 0, 0, c, false };
+	return command_trie.count++;
+}
+
+static void trie_insert(const char *name){
+	uint32_t node = 0;
+	for(; *name; name++){
+		//indices, not pointers: adding a node may move the array
+		uint32_t prev = 0, n = command_trie.nodes[node].child;
+		while(n && command_trie.nodes[n].c < *name){
+			prev = n;
+			n = command_trie.nodes[n].sibling;
+		}
+		if(n == 0 || command_trie.nodes[n].c != *name){
+			uint32_t added = trie_new_node(*name);
+			command_trie.nodes[added].sibling = n;
+			if(prev)
+				command_trie.nodes[prev].sibling = added;
+			else
+				command_trie.nodes[node].child = added;
+			n = added;
+		}
+		node = n;
+	}
+	command_trie.nodes[node].terminal = true;
+}
+
+static void trie_build(){
+	command_trie.count = 0;
+	trie_new_node('\0'); // root
+	for(size_t i = 0; i < BUILTIN_COUNT; i++)
+		trie_insert(builtins[i].name);
+	trie_insert("time"); // a prefix handled by process_command, not a builtin
+	for(int i = 0; i < path_dir_count; i++){
+		if(path_dirs[i].relative)
+			continue; // changes with cd, file completion covers it
+		DIR *d = opendir(path_dirs[i].dir);
+		if(d == NULL)
+			continue;
+		struct dirent *e;
+		struct stat st;
+		while((e = readdir(d)) != NULL){
+			if(e->d_name[0] == '.')
+				continue;
+			if(e->d_type != DT_REG && e->d_type != DT_LNK && e->d_type != DT_UNKNOWN)
+				continue;
+			if(fstatat(dirfd(d), e->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111))
+				trie_insert(e->d_name);
+		}
+		closedir(d);
+	}
+	command_trie.generation = path_generation;
+	command_trie.built = true;
+}
+
+static void trie_collect(uint32_t node, char *name, size_t len, const char ***out, size_t *count, size_t *cap){
+	for(uint32_t n = command_trie.nodes[node].child; n; n = command_trie.nodes[n].sibling){
+		if(len + 1 >= PATH_MAX)
+			continue;
+		name[len] = command_trie.nodes[n].c;
+		if(command_trie.nodes[n].terminal){
+			if(*count == *cap){
+				*cap = *cap ? *cap * 2 : 64;
+				*out = realloc(*out, *cap * sizeof(char *));
+			}
+			(*out)[(*count)++] = arena_strndup(&complete_arena, name, len + 1);
+		}
+		trie_collect(n, name, len + 1, out, count, cap);
+	}
+}
+
+static int dir_name_cmp(const void *a, const void *b){
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Sorted listing of a directory, from the cache while the directory's
+ * mtime is unchanged
+ * @param  path directory
+ * @return      the listing, NULL if it can't be read
+ */
+static struct dir_listing *dir_listing_get(const char *path){
+	struct stat st;
+	if(stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+		return NULL;
+	struct dir_listing *l = &dir_listings[0];
+	for(int i = 0; i < COMPLETE_DIR_CACHE; i++){
+		struct dir_listing *c = &dir_listings[i];
+		if(c->names != NULL && c->dev == st.st_dev && c->ino == st.st_ino){
+			l = c;
+			if(c->mtime.tv_sec == st.st_mtim.tv_sec && c->mtime.tv_nsec == st.st_mtim.tv_nsec){
+				c->used = ++dir_listing_clock;
+				return c;
+			}
+			break;
+		}
+		if(c->used < l->used)
+			l = c;
+	}
+	DIR *d = opendir(path);
+	if(d == NULL)
+		return NULL;
+	free(l->names);
+	free(l->blob);
+	size_t len = 0, cap = 65536, count = 0, names_cap = 1024;
+	char *blob = malloc(cap);
+	size_t *offsets = malloc(names_cap * sizeof(size_t));
+	struct dirent *e;
+	while((e = readdir(d)) != NULL){
+		if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		size_t n = strlen(e->d_name) + 2; // NUL, then d_type
+		if(len + n > cap){
+			while(len + n > cap) cap *= 2;
+			blob = realloc(blob, cap);
+		}
+		if(count == names_cap){
+			names_cap *= 2;
+			offsets = realloc(offsets, names_cap * sizeof(size_t));
+		}
+		memcpy(blob + len, e->d_name, n - 1);
+		blob[len + n - 1] = e->d_type;
+		offsets[count++] = len;
+		len += n;
+	}
+	closedir(d);
+	l->names = malloc((count ? count : 1) * sizeof(char *));
+	for(size_t i = 0; i < count; i++)
+		l->names[i] = blob + offsets[i];
+	free(offsets);
+	qsort(l->names, count, sizeof(char *), dir_name_cmp);
+	l->blob = blob;
+	l->count = count;
+	l->dev = st.st_dev;
+	l->ino = st.st_ino;
+	l->mtime = st.st_mtim;
+	l->used = ++dir_listing_clock;
+	return l;
+}
+
+/**
+ * Candidates for the word being completed
+ * @param  word    the word up to the cursor, dequoted
+ * @param  len     its length
+ * @param  command true for the first word of a pipeline stage
+ * @param  matches set to the sorted candidates, valid until the next call.
+ *                 File names are only the part after the word's last '/',
+ *                 directories end in '/'
+ * @return         number of candidates
+ */
+size_t complete_word(const char *word, size_t len, bool command, const char ***matches){
+	static const char **out;
+	static size_t cap;
+	size_t count = 0;
+	arena_reset(&complete_arena);
+	*matches = out;
+
+	if(command && memchr(word, '/', len) == NULL){
+		path_cache_validate();
+		if(!command_trie.built || command_trie.generation != path_generation)
+			trie_build();
+		uint32_t node = 0;
+		for(size_t i = 0; i < len && node != UINT32_MAX; i++){
+			uint32_t n = command_trie.nodes[node].child;
+			while(n && command_trie.nodes[n].c != word[i])
+				n = command_trie.nodes[n].sibling;
+			node = n ? n : UINT32_MAX;
+		}
+		if(node == UINT32_MAX)
+			return 0;
+		char name[PATH_MAX];
+		if(len >= sizeof(name))
+			return 0;
+		memcpy(name, word, len);
+		if(command_trie.nodes[node].terminal && len > 0){
+			if(cap == 0){
+				cap = 64;
+				out = malloc(cap * sizeof(char *));
+			}
+			out[count++] = arena_strndup(&complete_arena, name, len);
+		}
+		trie_collect(node, name, len, &out, &count, &cap);
+		*matches = out;
+		return count;
+	}
+
+	//split into the directory to list and the prefix of the name in it
+	const char *slash = memrchr(word, '/', len);
+	const char *base = slash ? slash + 1 : word;
+	size_t base_len = word + len - base;
+	char dir[PATH_MAX];
+	const char *home = getenv("HOME");
+	if(slash == NULL)
+		strcpy(dir, ".");
+	else if(word[0] == '~' && (word + 1 == slash) && home != NULL)
+		snprintf(dir, sizeof(dir), "%s/", home);
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word + 1), word);
+	struct dir_listing *l = dir_listing_get(dir);
+	if(l == NULL)
+		return 0;
+
+	//the names starting with base are one contiguous run in the sorted listing
+	size_t lo = 0, hi = l->count;
+	while(lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if(strncmp(l->names[mid], base, base_len) < 0) lo = mid + 1;
+		else hi = mid;
+	}
+	size_t end = lo;
+	while(end < l->count && strncmp(l->names[end], base, base_len) == 0)
+		end++;
+	for(size_t i = lo; i < end; i++){
+		const char *name = l->names[i];
+		if(name[0] == '.' && (base_len == 0 || base[0] != '.'))
+			continue; // hidden unless asked for
+		size_t name_len = strlen(name);
+		unsigned char type = name[name_len + 1];
+		bool is_dir = type == DT_DIR;
+		if((type == DT_LNK || type == DT_UNKNOWN) && end - lo <= COMPLETE_STAT_LIMIT){
+			struct stat st;
+			char full[PATH_MAX];
+			snprintf(full, sizeof(full), "%s%s%s", dir, slash ? "" : "/", name);
+			is_dir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+		}
+		if(count == cap){
+			cap = cap ? cap * 2 : 64;
+			out = realloc(out, cap * sizeof(char *));
+		}
+		char *m = arena_alloc(&complete_arena, name_len + 2);
+		memcpy(m, name, name_len);
+		m[name_len] = '/';
+		m[name_len + is_dir] = '\0';
+		out[count++] = m;
+	}
+	*matches = out;
+	return count;
+}
+
+//TIME: `time [-c] pipeline` reports wall, user and sys time, peak RSS,
+//context switches and page faults of every stage and the total. Processes
+//are measured by wait4, thread stages by RUSAGE_THREAD and a lone builtin
+//by RUSAGE_SELF. With -c, hardware counters are attached to each stage
+//through perf_event_open, inherited by whatever the stage starts.
+#define TIME_COUNTERS 3
+#define TIME_NOT_COUNTED UINT64_MAX
+
+static const struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+} time_counters[TIME_COUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+struct stage_usage {
+	struct timespec start, end;
+	struct rusage ru;
+	int counter_fds[TIME_COUNTERS]; // -1 when not attached
+	uint64_t counts[TIME_COUNTERS]; // TIME_NOT_COUNTED when unavailable
+};
+
+//What the next run_pipeline should measure, set by time_command
+static struct {
+	bool on;
+	bool counters;
+	int counter_errno; // why a counter couldn't be opened, 0 if all could
+} time_request;
+
+static void usage_init(struct stage_usage *u){
+	memset(u, 0, sizeof(*u));
+	for(int i = 0; i < TIME_COUNTERS; i++){
+		u->counter_fds[i] = -1;
+		u->counts[i] = TIME_NOT_COUNTED;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &u->start);
+}
+
+/**
+ * Attach the counters to a task, counting from now on in user space. A
+ * process is attached right after it was launched, so the first
+ * microseconds after its exec are not counted.
+ * @param u   usage to fill
+ * @param pid the task, 0 for the calling thread
+ */
+static void usage_attach(struct stage_usage *u, pid_t pid){
+	for(int i = 0; i < TIME_COUNTERS; i++){
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = time_counters[i].type;
+		attr.config = time_counters[i].config;
+		attr.inherit = 1; // children and threads it starts count too
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		u->counter_fds[i] = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if(u->counter_fds[i] < 0)
+			time_request.counter_errno = errno;
+	}
+}
+
+//Read and close the counters, scaled up if the PMU was shared with others
+static void usage_read_counters(struct stage_usage *u){
+	for(int i = 0; i < TIME_COUNTERS; i++){
+		uint64_t v[3]; // value, time enabled, time running
+		if(u->counter_fds[i] < 0)
+			continue;
+		if(read(u->counter_fds[i], v, sizeof(v)) == sizeof(v))
+			u->counts[i] = v[2] > 0 && v[2] < v[1] ? (uint64_t)((double)v[0] * v[1] / v[2]) : v[0];
+		close(u->counter_fds[i]);
+		u->counter_fds[i] = -1;
+	}
+}
+
+static void usage_finish(struct stage_usage *u, const struct rusage *ru){
+	clock_gettime(CLOCK_MONOTONIC, &u->end);
+	if(ru != NULL)
+		u->ru = *ru;
+	usage_read_counters(u);
+}
+
+static double timespec_s(struct timespec t){
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static double timeval_s(struct timeval t){
+	return t.tv_sec + t.tv_usec / 1e6;
+}
+
+static void time_row(const char *name, double real, const struct rusage *ru, const uint64_t *counts,
+		bool counters){
+	fprintf(stderr, "%-12.12s %9.3fs %9.3fs %9.3fs %8.1fMB %7ld %7ld %9ld %7ld", name, real,
+			timeval_s(ru->ru_utime), timeval_s(ru->ru_stime), ru->ru_maxrss / 1024.0,
+			ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+	for(int i = 0; counters && i < TIME_COUNTERS; i++){
+		if(counts[i] == TIME_NOT_COUNTED)
+			fprintf(stderr, " %14s", "-");
+		else
+			fprintf(stderr, " %14llu", (unsigned long long)counts[i]);
+	}
+	fprintf(stderr, "\n");
+}
+
+/**
+ * Print one row per stage and a total: real time from the first start to
+ * the last end, summed CPU time, switches and faults, the largest RSS
+ * @param names    stage names, NULL for a stage that never started
+ * @param usage    their measurements
+ * @param n        number of stages
+ * @param counters show the counter columns
+ */
+static void time_report(char **names, struct stage_usage *usage, int n, bool counters){
+	struct rusage total;
+	uint64_t counts[TIME_COUNTERS];
+	memset(&total, 0, sizeof(total));
+	for(int i = 0; i < TIME_COUNTERS; i++)
+		counts[i] = 0;
+	double first = 0, last = 0;
+	fprintf(stderr, "%-12s %10s %10s %10s %10s %7s %7s %9s %7s", "stage", "real", "user", "sys",
+			"max rss", "vcsw", "ivcsw", "minflt", "majflt");
+	for(int i = 0; counters && i < TIME_COUNTERS; i++)
+		fprintf(stderr, " %14s", time_counters[i].name);
+	fprintf(stderr, "\n");
+	for(int s = 0; s < n; s++){
+		struct stage_usage *u = &usage[s];
+		double start = timespec_s(u->start), end = timespec_s(u->end);
+		if(names[s] == NULL)
+			continue;
+		time_row(names[s], end - start, &u->ru, u->counts, counters);
+		if(first == 0 || start < first) first = start;
+		if(end > last) last = end;
+		timeradd(&total.ru_utime, &u->ru.ru_utime, &total.ru_utime);
+		timeradd(&total.ru_stime, &u->ru.ru_stime, &total.ru_stime);
+		if(u->ru.ru_maxrss > total.ru_maxrss) total.ru_maxrss = u->ru.ru_maxrss;
+		total.ru_nvcsw += u->ru.ru_nvcsw;
+		total.ru_nivcsw += u->ru.ru_nivcsw;
+		total.ru_minflt += u->ru.ru_minflt;
+		total.ru_majflt += u->ru.ru_majflt;
+		for(int i = 0; i < TIME_COUNTERS; i++)
+			if(counts[i] != TIME_NOT_COUNTED)
+				counts[i] = u->counts[i] == TIME_NOT_COUNTED ? TIME_NOT_COUNTED : counts[i] + u->counts[i];
+	}
+	if(n > 1)
+		time_row("total", last - first, &total, counts, counters);
+	if(counters && time_request.counter_errno != 0)
+		fprintf(stderr, "-%s: time: counters unavailable: %s\n", sysname, strerror(time_request.counter_errno));
+}
+
+/**
+ * time [-c] pipeline: run the rest of the line and report what each stage
+ * used. The prefix is taken off the first stage in place.
+ * @param  command the whole line, starting with time
+ * @return         what process_command returned for the rest
+ */
+int time_command(struct command_t *command){
+	bool counters = false;
+	int skip = 1;
+	while(skip <= command->arg_count && strcmp(command->argv[skip], "-c") == 0){
+		counters = true;
+		skip++;
+	}
+	if(skip > command->arg_count){ // nothing to time
+		struct stage_usage u;
+		char *name = "-";
+		usage_init(&u);
+		usage_finish(&u, NULL);
+		time_report(&name, &u, 1, false);
+		return SUCCESS;
+	}
+	command->argv += skip;
+	command->args = command->argv + 1;
+	command->arg_count -= skip;
+	command->name = command->argv[0];
+	time_request.counter_errno = 0;
+	time_request.counters = counters;
+
+	//a lone builtin that runs in the shell: measure the shell itself
+	const struct builtin *b = builtin_find(command);
+	if(builtin_in_shell(b, command)){
+		struct stage_usage u;
+		struct rusage before, after;
+		usage_init(&u);
+		getrusage(RUSAGE_SELF, &before);
+		if(counters)
+			usage_attach(&u, 0);
+		int code = process_command(command);
+		getrusage(RUSAGE_SELF, &after);
+		timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+		timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+		after.ru_nvcsw -= before.ru_nvcsw;
+		after.ru_nivcsw -= before.ru_nivcsw;
+		after.ru_minflt -= before.ru_minflt;
+		after.ru_majflt -= before.ru_majflt;
+		usage_finish(&u, &after); // max rss stays the shell's own peak
+		time_report(&command->name, &u, 1, counters);
+		return code;
+	}
+	time_request.on = true;
+	int code = process_command(command);
+	time_request.on = false;
+	return code;
+}
+
+//SPAWNING EXTERNAL COMMANDS
+/**
+ * Launch an external command with posix_spawn. glibc implements it with
+ * clone(CLONE_VM|CLONE_VFORK), so launch cost does not grow with the
+ * shell's page tables the way fork() does.
+ * @param  command    [description]
+ * @param  pathname   resolved executable
+ * @param  rd         its fds 0-2, from io_redirect
+ * @param  pgid       process group to join, 0 to lead a new one; ignored without job control
+ * @param  foreground hand the terminal to the new group
+ * @param  pid        set to the child's pid
+ * @return            0 or an errno value
+ */
+int spawn_command(struct command_t *command, const char *pathname, struct redirection *rd,
+		pid_t pgid, bool foreground, pid_t *pid){
+	extern char **environ;
+
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawnattr_init(&attr);
+
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGTTOU);
+	sigaddset(&defaults, SIGPIPE);
+	sigaddset(&defaults, SIGTSTP);
+	sigaddset(&defaults, SIGTTIN);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	sigset_t mask; //the shell blocks SIGCHLD for its signalfd
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setpgroup(&attr, pgid);
+	posix_spawnattr_setflags(&attr, (job_control ? POSIX_SPAWN_SETPGROUP : 0) | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+	int r = 0;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35)
+	if(foreground && pgid == 0) //take the terminal before exec, no SIGTTIN race
+		r = posix_spawn_file_actions_addtcsetpgrp_np(&fa, STDIN_FILENO);
+#endif
+	//pipe ends and redirected files are O_CLOEXEC, only the dup2'd copies survive exec
+	for(int i = 0; i < 3 && r == 0; i++)
+		if(rd->fd[i] != i)
+			r = posix_spawn_file_actions_adddup2(&fa, rd->fd[i], i);
+	if(r == 0){
+		fflush(stdout); //keep our buffered output ahead of the child's
+		TRACE_BEGIN(trace_start); // returns once the child has exec'd
+		r = posix_spawn(pid, pathname, &fa, &attr, command->argv, environ);
+		TRACE_END(trace_start, "spawn+exec", pathname);
+	}
+#if !(defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 35))
+	if(r == 0 && foreground && pgid == 0){
+		tcsetpgrp(STDIN_FILENO, *pid);
+		kill(-*pid, SIGCONT); //in case it hit the terminal before we handed it over
+	}
+#endif
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	return r;
+}
+
+static int exit_status(int status){
+	if(WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if(WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 0;
+}
+
+/**
+ * Run a builtin as a pipeline stage in a forked child wired to the pipe
+ * @param  b          the builtin
+ * @param  command    [description]
+ * @param  rd         its fds 0-2, from io_redirect
+ * @param  pgid       process group to join, 0 to lead a new one; ignored without job control
+ * @param  foreground hand the terminal to the new group
+ * @param  pid        set to the child's pid
+ * @return            0 or an errno value
+ */
+static int fork_builtin(const struct builtin *b, struct command_t *command, struct redirection *rd,
+		pid_t pgid, bool foreground, pid_t *pid){
+	fflush(stdout);
+	TRACE_BEGIN(trace_start);
+	*pid = fork();
+	if(*pid < 0)
+		return errno;
+	if(*pid == 0){
+		__atomic_store_n(&trace_enabled, false, __ATOMIC_RELAXED); // its ring is a copy nobody dumps
+		if(job_control)
+			setpgid(0, pgid);
+		if(foreground && pgid == 0)
+			tcsetpgrp(STDIN_FILENO, getpgrp());
+		signal(SIGTTOU, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		sigset_t mask;
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		//stdio builtins print to fd 1, and nothing else of the shell's may stay
+		//open: a pipe end kept here would hold off EOF for another stage
+		for(int i = 0; i < 3; i++)
+			if(rd->fd[i] != i)
+				dup2(rd->fd[i], i);
+		close_range(3, ~0U, 0);
+		int status = b->run(command, STDIN_FILENO, STDOUT_FILENO);
+		fflush(stdout);
+		_exit(status);
+	}
+	if(job_control)
+		setpgid(*pid, pgid ? pgid : *pid); //avoid racing the child's own setpgid
+	TRACE_END(trace_start, "fork", command->name);
+	return 0;
+}
+
+//A BUILTIN_FDS stage running on a thread of the shell, it owns its pipe ends
+struct stage_thread {
+	pthread_t thread;
+	const struct builtin *builtin;
+	struct command_t *command;
+	int in_fd, out_fd; // -1 for the shell's own stdin/stdout
+	int status;
+	struct stage_usage *usage; // NULL unless timed
+	bool counters;
+};
+
+static void *stage_thread_main(void *arg){
+	struct stage_thread *t = arg;
+	if(t->usage != NULL && t->counters)
+		usage_attach(t->usage, 0);
+	TRACE_BEGIN(trace_start);
+	t->status = t->builtin->run(t->command, t->in_fd >= 0 ? t->in_fd : STDIN_FILENO,
+			t->out_fd >= 0 ? t->out_fd : STDOUT_FILENO);
+	TRACE_END(trace_start, "builtin", t->command->name);
+	if(t->usage != NULL){
+		struct rusage ru;
+		getrusage(RUSAGE_THREAD, &ru); // max rss is the whole shell's
+		usage_finish(t->usage, &ru);
+	}
+	//closing is what tells the neighbours: EOF downstream, EPIPE upstream
+	if(t->in_fd >= 0) close(t->in_fd);
+	if(t->out_fd >= 0) close(t->out_fd);
+	return NULL;
+}
+
+//JOB CONTROL: every pipeline is a job with its own process group. In an
+//interactive shell SIGCHLD stays blocked and arrives on a signalfd, so
+//children are reaped by plain code with wait4(-1): while a foreground job
+//runs, at the prompt as soon as one exits, and before each line in batch mode.
+//Background jobs that finished are announced at the next prompt.
+enum job_state {
+	JOB_RUNNING,
+	JOB_STOPPED,
+	JOB_DONE,
+};
+
+struct job_stage {
+	pid_t pid; // 0 for a thread stage or a stage that failed to start
+	struct stage_thread *thread;
+	int status; // exit status once finished
+	int signal; // the signal that killed it, 0 if it exited
+	bool finished;
+	bool stopped;
+	char *name; // for time and trace, NULL unless timed or traced
+	struct stage_usage usage;
+	uint64_t trace_start; // launch time, 0 unless traced
+};
+
+struct job {
+	int id; // %id
+	pid_t pgid; // 0 when every stage runs in the shell, or without job control
+	int count;
+	struct job_stage *stages;
+	char *text; // the command line, for jobs and notices
+	enum job_state state;
+	bool notified; // a background stop was already announced
+	bool owns_tty; // the terminal was handed to it
+	bool timed; // report usage when it finishes
+	bool counters;
+	bool has_tmodes;
+	struct termios tmodes; // its terminal modes when it stopped
+	unsigned long order; // larger is more recent, for %+ and %-
+};
+
+static struct job **job_table; // slot id-1, NULL for a free id
+static int job_table_size;
+static int job_count;
+static unsigned long job_clock;
+static int job_signal_fd = -1;
+static struct termios shell_tmodes;
+
+static const struct {
+	const char *name;
+	int sig;
+} signal_names[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM },
+	{ "TERM", SIGTERM }, { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+	{ "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }, { "WINCH", SIGWINCH },
+};
+
+/**
+ * Take over the terminal for an interactive session: lead our own process
+ * group, ignore the job control stop signals and route SIGCHLD to a signalfd.
+ * Called before any thread or child exists, so all of them inherit the mask.
+ */
+void job_control_init(){
+	setpgid(0, 0); // fails harmlessly for a session leader
+	tcsetpgrp(STDIN_FILENO, getpgrp());
+	signal(SIGTSTP, SIG_IGN);
+	signal(SIGTTIN, SIG_IGN);
+	tcgetattr(STDIN_FILENO, &shell_tmodes);
+	sigset_t chld;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, NULL);
+	job_signal_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+	job_control = true;
+}
+
+/**
+ * The fd that becomes readable when a child changed state
+ * @return -1 outside an interactive shell
+ */
+int job_event_fd(){
+	return job_signal_fd;
+}
+
+//The command line as typed, near enough, rebuilt from the parsed pipeline
+static char *job_text(struct command_t *command){
+	size_t len = 3;
+	for(struct command_t *c = command; c; c = c->next){
+		for(char **a = c->argv; *a; a++)
+			len += strlen(*a) + 1;
+		for(int i = 0; i < c->redirect_count; i++)
+			len += (c->redirects[i].target ? strlen(c->redirects[i].target) : 0) + 7;
+		len += 3;
+	}
+	char *text = malloc(len), *p = text;
+	for(struct command_t *c = command; c; c = c->next){
+		for(char **a = c->argv; *a; a++)
+			p += sprintf(p, "%s%s", a == c->argv ? "" : " ", *a);
+		for(int i = 0; i < c->redirect_count; i++){
+			struct redirect *r = &c->redirects[i];
+			p += sprintf(p, " %s%s%s", redirect_ops[r->op].text, r->target ? " " : "", r->target ? r->target : "");
+		}
+		if(c->next != NULL)
+			p += sprintf(p, " | ");
+	}
+	if(command->background)
+		strcpy(p, " &");
+	return text;
+}
+
+static struct job *job_new(struct command_t *command, int count){
+	int slot = 0;
+	while(slot < job_table_size && job_table[slot] != NULL)
+		slot++;
+	if(slot == job_table_size){
+		job_table_size = job_table_size ? job_table_size * 2 : 16;
+		job_table = realloc(job_table, job_table_size * sizeof(struct job *));
+		memset(job_table + slot, 0, (job_table_size - slot) * sizeof(struct job *));
+	}
+	struct job *j = calloc(1, sizeof(struct job));
+	j->id = slot + 1;
+	j->count = count;
+	j->stages = calloc(count, sizeof(struct job_stage));
+	j->text = job_text(command);
+	j->order = ++job_clock;
+	j->timed = time_request.on;
+	j->counters = time_request.counters;
+	int i = 0;
+	for(struct command_t *c = command; (j->timed || TRACE_ON()) && c; c = c->next)
+		j->stages[i++].name = strdup(c->name);
+	job_table[slot] = j;
+	job_count++;
+	return j;
+}
+
+static void job_free(struct job *j){
+	job_table[j->id - 1] = NULL;
+	job_count--;
+	for(int i = 0; i < j->count; i++)
+		free(j->stages[i].name);
+	free(j->stages);
+	free(j->text);
+	free(j);
+}
+
+//Exit status of a finished job: the last stage's, or with pipefail the rightmost failure
+static int job_status(struct job *j){
+	int status = 0, failed = 0;
+	for(int i = 0; i < j->count; i++){
+		status = j->stages[i].status;
+		if(status != 0)
+			failed = status;
+	}
+	return pipefail ? failed : status;
+}
+
+//Collect a thread stage once it was joined
+static void job_thread_done(struct job_stage *s){
+	s->status = s->thread->status;
+	s->finished = true;
+	free(s->thread);
+	s->thread = NULL;
+}
+
+//Recompute the state from the stages, joining thread stages that returned
+static void job_update(struct job *j){
+	bool running = false, stopped = false, done = true;
+	for(int i = 0; i < j->count; i++){
+		struct job_stage *s = &j->stages[i];
+		if(s->thread != NULL && pthread_tryjoin_np(s->thread->thread, NULL) == 0)
+			job_thread_done(s);
+		if(s->finished)
+			continue;
+		done = false;
+		if(s->stopped) stopped = true;
+		else if(s->pid != 0) running = true;
+	}
+	//a thread blocked on a stopped neighbour doesn't keep the job running
+	j->state = done ? JOB_DONE : stopped && !running ? JOB_STOPPED : JOB_RUNNING;
+}
+
+static void job_record(pid_t pid, int status, const struct rusage *ru){
+	for(int slot = 0; slot < job_table_size; slot++){
+		struct job *j = job_table[slot];
+		for(int i = 0; j != NULL && i < j->count; i++){
+			struct job_stage *s = &j->stages[i];
+			if(s->pid != pid)
+				continue;
+			if(WIFSTOPPED(status)){
+				s->stopped = true;
+			} else if(WIFCONTINUED(status)){
+				s->stopped = false;
+			} else {
+				s->finished = true;
+				s->stopped = false;
+				s->status = exit_status(status);
+				s->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+				if(j->timed)
+					usage_finish(&s->usage, ru);
+				if(s->trace_start >= trace_epoch && TRACE_ON()) // launched during this trace
+					trace_record("process", s->name, s->trace_start, pid);
+			}
+			job_update(j);
+			return;
+		}
+	}
+}
+
+/**
+ * Collect every child that changed state, without blocking
+ */
+void job_reap(){
+	if(job_signal_fd >= 0){
+		struct signalfd_siginfo info[8];
+		while(read(job_signal_fd, info, sizeof(info)) > 0)
+			; //SIGCHLDs coalesce, waitpid below finds every child
+	}
+	if(job_count == 0)
+		return;
+	int status;
+	pid_t pid;
+	struct rusage ru;
+	while((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+		job_record(pid, status, &ru);
+}
+
+//Block until the job finished or, with job control, stopped
+static void job_wait(struct job *j){
+	job_update(j);
+	while(j->state == JOB_RUNNING){
+		bool processes = false;
+		for(int i = 0; i < j->count; i++)
+			if(!j->stages[i].finished && !j->stages[i].stopped && j->stages[i].pid != 0)
+				processes = true;
+		if(processes){
+			int status;
+			struct rusage ru;
+			pid_t pid = wait4(-1, &status, job_control ? WUNTRACED : 0, &ru);
+			if(pid > 0){
+				job_record(pid, status, &ru);
+				continue;
+			}
+			if(errno == EINTR)
+				continue;
+			for(int i = 0; i < j->count; i++) //ECHILD: someone else reaped them
+				if(j->stages[i].pid != 0)
+					j->stages[i].finished = true;
+		} else {
+			//only threads left, and nothing they wait on is stopped
+			for(int i = 0; i < j->count; i++){
+				if(j->stages[i].thread != NULL){
+					pthread_join(j->stages[i].thread->thread, NULL);
+					job_thread_done(&j->stages[i]);
+				}
+			}
+		}
+		job_update(j);
+	}
+}
+
+static void job_time_report(struct job *j){
+	if(!j->timed)
+		return;
+	char **names = calloc(j->count, sizeof(char *));
+	struct stage_usage *usage = calloc(j->count, sizeof(struct stage_usage));
+	for(int i = 0; i < j->count; i++){
+		if(j->stages[i].pid != 0 || j->stages[i].usage.end.tv_sec != 0) // it ran
+			names[i] = j->stages[i].name;
+		usage[i] = j->stages[i].usage;
+	}
+	time_request.counters = j->counters;
+	time_report(names, usage, j->count, j->counters);
+	free(names);
+	free(usage);
+}
+
+//The most recent job is %+, the one before it %-
+static void job_marks(struct job **current, struct job **previous){
+	*current = *previous = NULL;
+	for(int slot = 0; slot < job_table_size; slot++){
+		struct job *j = job_table[slot];
+		if(j == NULL)
+			continue;
+		if(*current == NULL || j->order > (*current)->order){
+			*previous = *current;
+			*current = j;
+		} else if(*previous == NULL || j->order > (*previous)->order){
+			*previous = j;
+		}
+	}
+}
+
+static char job_mark(struct job *j){
+	struct job *current, *previous;
+	job_marks(&current, &previous);
+	return j == current ? '+' : j == previous ? '-' : ' ';
+}
+
+//"Running", "Done", "Exit 2", "Killed", ...
+static void job_state_text(struct job *j, char *out, size_t size){
+	if(j->state == JOB_RUNNING){
+		snprintf(out, size, "Running");
+	} else if(j->state == JOB_STOPPED){
+		snprintf(out, size, "Stopped");
+	} else {
+		int status = j->stages[j->count - 1].status, sig = j->stages[j->count - 1].signal;
+		if(sig != 0)
+			snprintf(out, size, "%s", strsignal(sig));
+		else if(status != 0)
+			snprintf(out, size, "Exit %d", status);
+		else
+			snprintf(out, size, "Done");
+	}
+}
+
+//The pid jobs -l and -p show: the process group, or the first child without one
+static pid_t job_leader(struct job *j){
+	for(int i = 0; i < j->count && j->pgid == 0; i++)
+		if(j->stages[i].pid != 0)
+			return j->stages[i].pid;
+	return j->pgid;
+}
+
+//Signal a job's process group, or each of its running children without one
+static int job_kill(struct job *j, int sig){
+	if(j->pgid != 0)
+		return kill(-j->pgid, sig);
+	int r = -1;
+	errno = ESRCH;
+	for(int i = 0; i < j->count; i++)
+		if(j->stages[i].pid != 0 && !j->stages[i].finished && kill(j->stages[i].pid, sig) == 0)
+			r = 0;
+	return r;
+}
+
+static void job_print(struct job *j, bool pids){
+	char state[64];
+	job_state_text(j, state, sizeof(state));
+	printf("[%d]%c  ", j->id, job_mark(j));
+	if(pids)
+		printf("%d ", (int)job_leader(j));
+	printf("%-24s%s\n", state, j->text);
+}
+
+/**
+ * Announce jobs that finished or stopped since the last prompt, and forget
+ * the finished ones. Between prompts the table only holds background and
+ * stopped jobs. Without job control finished jobs are forgotten quietly,
+ * as a script's background jobs are.
+ */
+void job_notify(){
+	job_reap();
+	for(int slot = 0; slot < job_table_size; slot++){
+		struct job *j = job_table[slot];
+		if(j == NULL)
+			continue;
+		if(j->state == JOB_DONE){
+			if(job_control)
+				job_print(j, false);
+			job_time_report(j);
+			job_free(j);
+		} else if(j->state == JOB_STOPPED && !j->notified){
+			job_print(j, false);
+			j->notified = true;
+		}
+	}
+}
+
+/**
+ * Wait for a job in the foreground, continuing it first if asked, and take
+ * the terminal back afterwards. A finished job is forgotten; a stopped one
+ * stays in the table with its terminal modes saved.
+ * @param  j      the job
+ * @param  resume send SIGCONT, for fg
+ * @return        its exit status, 128+SIGTSTP if it stopped
+ */
+static int job_foreground(struct job *j, bool resume){
+	if(resume){
+		if(j->owns_tty){
+			if(j->has_tmodes)
+				tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+			tcsetpgrp(STDIN_FILENO, j->pgid);
+		}
+		for(int i = 0; i < j->count; i++)
+			j->stages[i].stopped = false;
+		if(j->pgid != 0)
+			kill(-j->pgid, SIGCONT);
+	}
+	TRACE_BEGIN(trace_start);
+	job_wait(j);
+	TRACE_END(trace_start, "wait", j->text);
+	if(j->owns_tty){
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+		if(j->state == JOB_STOPPED){
+			j->has_tmodes = tcgetattr(STDIN_FILENO, &j->tmodes) == 0;
+			tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+		}
+	}
+	if(j->state == JOB_STOPPED){
+		j->order = ++job_clock;
+		j->notified = true;
+		printf("\n");
+		job_print(j, false);
+		return 128 + SIGTSTP;
+	}
+	int status = job_status(j);
+	job_time_report(j);
+	job_free(j);
+	return status;
+}
+
+/**
+ * Resolve a job spec: %n, %% or %+ (current), %- (previous), %prefix of the
+ * command line, or a pid when pids are allowed
+ * @param  spec   the argument, NULL for the current job
+ * @param  who    builtin name for errors
+ * @param  pid    set to the pid for a bare number, NULL if pids are not accepted
+ * @return        the job, NULL if there is none (an error was printed unless *pid was set)
+ */
+static struct job *job_parse(const char *spec, const char *who, pid_t *pid){
+	struct job *current, *previous, *found = NULL;
+	job_marks(&current, &previous);
+	if(pid != NULL)
+		*pid = 0;
+	if(spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0){
+		found = current;
+	} else if(strcmp(spec, "%-") == 0){
+		found = previous;
+	} else if(spec[0] == '%' && isdigit((unsigned char)spec[1])){
+		int id = atoi(spec + 1);
+		if(id > 0 && id <= job_table_size)
+			found = job_table[id - 1];
+	} else if(spec[0] == '%'){
+		for(int slot = 0; slot < job_table_size; slot++){
+			struct job *j = job_table[slot];
+			if(j != NULL && strncmp(j->text, spec + 1, strlen(spec + 1)) == 0
+					&& (found == NULL || j->order > found->order))
+				found = j;
+		}
+	} else if(pid != NULL && isdigit((unsigned char)spec[0])){
+		*pid = atoi(spec);
+		for(int slot = 0; slot < job_table_size && found == NULL; slot++)
+			for(int i = 0; job_table[slot] != NULL && i < job_table[slot]->count; i++)
+				if(job_table[slot]->stages[i].pid == *pid)
+					found = job_table[slot];
+		return found;
+	}
+	if(found == NULL)
+		printf("-%s: %s: %s: no such job\n", sysname, who, spec ? spec : "current");
+	return found;
+}
+
+//JOBS BUILTIN: jobs [-l|-p], -l adds the process group, -p prints only that
+int jobs_builtin(struct command_t *command, int in_fd, int out_fd){
+	bool pids = false, only_pids = false;
+	for(int i = 0; i < command->arg_count; i++){
+		if(strcmp(command->args[i], "-l") == 0) pids = true;
+		else if(strcmp(command->args[i], "-p") == 0) only_pids = true;
+		else {
+			printf("-%s: jobs: usage: jobs [-l|-p]\n", sysname);
+			return 2;
+		}
+	}
+	job_reap();
+	for(int slot = 0; slot < job_table_size; slot++){
+		struct job *j = job_table[slot];
+		if(j == NULL)
+			continue;
+		if(only_pids)
+			printf("%d\n", (int)job_leader(j));
+		else
+			job_print(j, pids);
+		if(j->state == JOB_STOPPED)
+			j->notified = true;
+		if(j->state == JOB_DONE) // reported here, not again at the prompt
+			job_free(j);
+	}
+	return 0;
+}
+
+//FG BUILTIN: fg [job], continue a job with the terminal and wait for it
+int fg_builtin(struct command_t *command, int in_fd, int out_fd){
+	if(!job_control){
+		printf("-%s: fg: no job control\n", sysname);
+		return 1;
+	}
+	job_reap();
+	struct job *j = job_parse(command->arg_count > 0 ? command->args[0] : NULL, "fg", NULL);
+	if(j == NULL)
+		return 1;
+	printf("%s\n", j->text);
+	fflush(stdout);
+	j->owns_tty = j->pgid != 0;
+	return job_foreground(j, true);
+}
+
+//BG BUILTIN: bg [job...], continue stopped jobs in the background
+int bg_builtin(struct command_t *command, int in_fd, int out_fd){
+	if(!job_control){
+		printf("-%s: bg: no job control\n", sysname);
+		return 1;
+	}
+	job_reap();
+	int status = 0;
+	for(int a = 0; a == 0 || a < command->arg_count; a++){
+		struct job *j = job_parse(command->arg_count > 0 ? command->args[a] : NULL, "bg", NULL);
+		if(j == NULL){
+			status = 1;
+			continue;
+		}
+		if(j->state != JOB_STOPPED){
+			printf("-%s: bg: job %d already in background\n", sysname, j->id);
+			continue;
+		}
+		j->notified = false;
+		j->owns_tty = false;
+		for(int i = 0; i < j->count; i++)
+			j->stages[i].stopped = false;
+		j->state = JOB_RUNNING;
+		kill(-j->pgid, SIGCONT);
+		printf("[%d]%c %s &\n", j->id, job_mark(j), j->text);
+	}
+	return status;
+}
+
+//WAIT BUILTIN: wait [job|pid...], with no arguments for every running job
+int wait_builtin(struct command_t *command, int in_fd, int out_fd){
+	int status = 0;
+	if(command->arg_count == 0){
+		for(int slot = 0; slot < job_table_size; slot++){
+			struct job *j = job_table[slot];
+			if(j == NULL || j->state == JOB_STOPPED)
+				continue;
+			job_wait(j);
+			if(j->state == JOB_DONE)
+				job_free(j);
+		}
+		return 0;
+	}
+	for(int a = 0; a < command->arg_count; a++){
+		pid_t pid;
+		struct job *j = job_parse(command->args[a], "wait", &pid);
+		if(j == NULL){
+			if(pid != 0)
+				printf("-%s: wait: pid %d is not a child of this shell\n", sysname, (int)pid);
+			status = 127;
+			continue;
+		}
+		job_wait(j);
+		if(j->state == JOB_STOPPED){
+			status = 128 + SIGTSTP;
+			continue;
+		}
+		status = job_status(j);
+		job_free(j);
+	}
+	return status;
+}
+
+static int signal_parse(const char *s){
+	if(isdigit((unsigned char)s[0]))
+		return atoi(s);
+	if(strncasecmp(s, "SIG", 3) == 0)
+		s += 3;
+	for(size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++)
+		if(strcasecmp(s, signal_names[i].name) == 0)
+			return signal_names[i].sig;
+	return -1;
+}
+
+//KILL BUILTIN: kill [-s sig | -sig] job|pid..., or kill -l to list signal names
+int kill_builtin(struct command_t *command, int in_fd, int out_fd){
+	int sig = SIGTERM, a = 0, status = 0;
+	if(command->arg_count > 0 && strcmp(command->args[0], "-l") == 0){
+		for(size_t i = 0; i < sizeof(signal_names) / sizeof(signal_names[0]); i++)
+			printf("%2d) SIG%s\n", signal_names[i].sig, signal_names[i].name);
+		return 0;
+	}
+	if(command->arg_count > 1 && strcmp(command->args[0], "-s") == 0){
+		sig = signal_parse(command->args[1]);
+		a = 2;
+	} else if(command->arg_count > 0 && command->args[0][0] == '-' && command->args[0][1] != '\0'){
+		sig = signal_parse(command->args[0] + 1);
+		a = 1;
+	}
+	if(sig < 0 || sig >= NSIG){
+		printf("-%s: kill: %s: invalid signal specification\n", sysname, command->args[a - 1]);
+		return 1;
+	}
+	if(a == command->arg_count){
+		printf("-%s: kill: usage: kill [-s sig | -sig] job|pid...\n", sysname);
+		return 2;
+	}
+	job_reap();
+	for(; a < command->arg_count; a++){
+		const char *target = command->args[a];
+		if(target[0] != '%'){
+			if(kill(atoi(target), sig) == -1){
+				printf("-%s: kill: (%s) - %s\n", sysname, target, strerror(errno));
+				status = 1;
+			}
+			continue;
+		}
+		struct job *j = job_parse(target, "kill", NULL);
+		if(j == NULL){
+			status = 1;
+			continue;
+		}
+		if(job_leader(j) == 0){
+			printf("-%s: kill: %s: runs inside the shell, it cannot be signalled\n", sysname, target);
+			status = 1;
+			continue;
+		}
+		if(job_kill(j, sig) == -1){
+			printf("-%s: kill: %s: %s\n", sysname, target, strerror(errno));
+			status = 1;
+			continue;
+		}
+		//a stopped job only acts on these once it runs again
+		if(j->state == JOB_STOPPED && (sig == SIGTERM || sig == SIGHUP))
+			job_kill(j, SIGCONT);
+	}
+	return status;
+}
+
+//PIPELINES
+/**
+ * Run a whole command->next chain as one job: every pipe is created up
+ * front and all stages are spawned concurrently into one process group.
+ * Builtins that work on fds run as threads of the shell instead of
+ * children, unless the pipeline goes to the background or the stage
+ * would read the terminal. A foreground job is waited for and sets
+ * last_status to the last stage's status, or with pipefail to the
+ * rightmost failing one; a background job is left in the job table.
+ * @param  command first stage
+ * @return         SUCCESS or UNKNOWN if a stage couldn't be started
+ */
+int run_pipeline(struct command_t *command){
+	int n = 0;
+	for(struct command_t *c = command; c; c = c->next)
+		n++;
+
+	char **paths = calloc(n, sizeof(char *));
+	const struct builtin **stage_builtins = calloc(n, sizeof(struct builtin *));
+	int (*pipes)[2] = malloc(sizeof(int[2]) * (n > 1 ? n - 1 : 1));
+	int result = SUCCESS, i = 0, started = 0;
+
+	//Resolve everything first so a typo doesn't leave half a pipeline running
+	for(struct command_t *c = command; c; c = c->next, i++){
+		if((stage_builtins[i] = builtin_find(c)) != NULL)
+			continue; //runs in a thread or a forked child, no path
+		char *path = path_lookup(c->name);
+		if(path == NULL){
+			printf("-%s: %s: command not found\n", sysname, c->name);
+			last_status = 127;
+			result = UNKNOWN;
+			goto out;
+		}
+		paths[i] = strdup(path);
+	}
+	for(i = 0; i < n - 1; i++){
+		if(pipe2(pipes[i], O_CLOEXEC) == -1){
+			printf("-%s: pipe: %s\n", sysname, strerror(errno));
+			while(i-- > 0){
+				close(pipes[i][0]);
+				close(pipes[i][1]);
+			}
+			last_status = 1;
+			result = UNKNOWN;
+			goto out;
+		}
+	}
+
+	bool foreground = job_control && !command->background && isatty(STDIN_FILENO)
+		&& tcgetpgrp(STDIN_FILENO) == getpgrp();
+	struct job *job = job_new(command, n);
+	pid_t pgid = 0;
+	i = 0;
+	for(struct command_t *c = command; c; c = c->next, i++){
+		const struct builtin *b = stage_builtins[i];
+		struct redirection rd;
+		TRACE_BEGIN(trace_start);
+		int redirected = io_redirect(c, i > 0 ? pipes[i-1][0] : -1, i < n - 1 ? pipes[i][1] : -1, &rd);
+		TRACE_END(trace_start, "redirect", c->name);
+		if(redirected != SUCCESS){
+			job->stages[i].finished = true;
+			job->stages[i].status = 1;
+			result = UNKNOWN;
+			continue;
+		}
+		if(job->timed)
+			usage_init(&job->stages[i].usage);
+		//a thread shares the shell's stderr, so a stage redirecting it is forked
+		if(b != NULL && (b->flags & BUILTIN_FDS) && !command->background && rd.fd[2] == STDERR_FILENO
+				&& (rd.fd[0] != STDIN_FILENO || !isatty(STDIN_FILENO))){
+			struct stage_thread *t = malloc(sizeof(struct stage_thread));
+			*t = (struct stage_thread){ .builtin = b, .command = c,
+				.in_fd = rd.fd[0] != STDIN_FILENO ? rd.fd[0] : -1,
+				.out_fd = rd.fd[1] != STDOUT_FILENO ? rd.fd[1] : -1,
+				.usage = job->timed ? &job->stages[i].usage : NULL, .counters = job->counters };
+			int r = pthread_create(&t->thread, NULL, stage_thread_main, t);
+			if(r != 0){
+				printf("-%s: %s: %s\n", sysname, c->name, strerror(r));
+				redirect_close(&rd);
+				free(t);
+				result = UNKNOWN;
+				continue;
+			}
+			job->stages[i].thread = t; // it closes its fds when done
+			started++;
+			continue;
+		}
+		pid_t *pid = &job->stages[i].pid;
+		job->stages[i].trace_start = TRACE_ON() ? trace_clock() : 0;
+		int r = paths[i] ? spawn_command(c, paths[i], &rd, pgid, foreground, pid)
+			: fork_builtin(b, c, &rd, pgid, foreground, pid);
+		//our copies of the fds this stage uses are no longer needed
+		redirect_close(&rd);
+		if(r != 0){
+			printf("-%s: %s: %s\n", sysname, c->name, strerror(r));
+			*pid = 0;
+			result = UNKNOWN;
+			continue;
+		}
+		if(pgid == 0 && job_control)
+			pgid = *pid;
+		if(job->counters)
+			usage_attach(&job->stages[i].usage, *pid);
+		started++;
+	}
+	//stages that never started count as command not found
+	for(i = 0; i < n; i++){
+		if(job->stages[i].pid == 0 && job->stages[i].thread == NULL && !job->stages[i].finished){
+			job->stages[i].finished = true;
+			job->stages[i].status = 127;
+		}
+	}
+	job->pgid = pgid;
+	job->owns_tty = foreground && pgid != 0;
+
+	if(started == 0){
+		job_free(job);
+	} else if(command->background){
+		job_update(job);
+		if(job_control)
+			printf("[%d] %d\n", job->id, (int)pgid);
+	} else {
+		last_status = job_foreground(job, false);
+	}
+
+out:
+	for(i = 0; i < n; i++)
+		free(paths[i]);
+	free(paths);
+	free(stage_builtins);
+	free(pipes);
+	return result;
+}
+
+//SET BUILTIN: only shell options for now
+int set_builtin(struct command_t *command, int in_fd, int out_fd){
+	if(command->arg_count == 2 && strcmp(command->args[1], "pipefail") == 0){
+		if(strcmp(command->args[0], "-o") == 0){
+			pipefail = true;
+			return 0;
+		}
+		if(strcmp(command->args[0], "+o") == 0){
+			pipefail = false;
+			return 0;
+		}
+	}
+	if(command->arg_count == 1 && strcmp(command->args[0], "-o") == 0){
+		printf("pipefail\t%s\n", pipefail ? "on" : "off");
+		return 0;
+	}
+	printf("-%s: set: usage: set [-o|+o] pipefail\n", sysname);
+	return 2;
+}
+
+//CHATROOM: one process per participant around an epoll loop. Every member
+//has a FIFO in /tmp/chatroom-<room>: our own is held open for reading, the
+//others' stay open for writing, and inotify on the directory reports who
+//joins and leaves (past the per-user inotify limit, a rescan every second
+//does). A message goes to each member with a non-blocking write;
+//what a slow reader's pipe can't take waits in that member's queue.
+#define CHAT_MAX_MESSAGE PIPE_BUF // writes up to this size never interleave with another sender's
+#define CHAT_QUEUE_LIMIT (1 << 20) // per member, messages past it are dropped
+#define CHAT_EVENTS 64
+#define CHAT_RESCAN_MS 1000 // membership rescan without inotify
+
+struct chat_peer {
+	char *name;
+	int fd; // -1 while nobody reads its FIFO
+	char *queue; // whole messages, each ending in a newline
+	size_t sent, queued, cap; // queue[sent..queued) is still to be written
+	bool listed; // seen by the current rescan
+};
+
+struct chat {
+	const char *room, *user;
+	char dir[PATH_MAX - NAME_MAX - 1]; // room for /member
+	int epoll_fd, inotify_fd, fifo_fd, stdin_fd; // inotify_fd -1: rescan instead
+	bool stdin_polled; // false for a file or /dev/null: epoll refuses them, they are read every pass
+	char in[CHAT_MAX_MESSAGE]; // stdin read so far, up to a partial line
+	size_t in_len;
+	struct chat_peer **peers;
+	int count, cap;
+	unsigned long dropped;
+};
+
+static bool chat_watch(struct chat *c, int fd, uint32_t events, void *tag, int op){
+	struct epoll_event ev = { .events = events, .data.ptr = tag };
+	return epoll_ctl(c->epoll_fd, op, fd, &ev) == 0;
+}
+
+//Open a member's FIFO for writing, fails with ENXIO until someone reads it
+static bool chat_open_peer(struct chat *c, struct chat_peer *p){
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", c->dir, p->name);
+	p->fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	return p->fd >= 0;
+}
+
+//The member left: drop the fd and whatever was queued for it
+static void chat_close_peer(struct chat *c, struct chat_peer *p){
+	if(p->fd >= 0)
+		close(p->fd); // also removes it from the epoll set
+	p->fd = -1;
+	p->sent = p->queued = 0;
+}
+
+static void chat_add_peer(struct chat *c, const char *name){
+	if(strcmp(name, c->user) == 0)
+		return;
+	for(int i = 0; i < c->count; i++){
+		if(strcmp(c->peers[i]->name, name) == 0){
+			c->peers[i]->listed = true;
+			return;
+		}
+	}
+	if(c->count == c->cap){
+		c->cap = c->cap ? c->cap * 2 : 16;
+		c->peers = realloc(c->peers, c->cap * sizeof(struct chat_peer *));
+	}
+	struct chat_peer *p = calloc(1, sizeof(struct chat_peer));
+	p->name = strdup(name);
+	p->listed = true;
+	chat_open_peer(c, p);
+	c->peers[c->count++] = p;
+}
+
+static void chat_remove_peer(struct chat *c, const char *name){
+	for(int i = 0; i < c->count; i++){
+		struct chat_peer *p = c->peers[i];
+		if(strcmp(p->name, name) != 0)
+			continue;
+		chat_close_peer(c, p);
+		free(p->name);
+		free(p->queue);
+		free(p);
+		c->peers[i] = c->peers[--c->count];
+		return;
+	}
+}
+
+//Write queued messages, at most CHAT_MAX_MESSAGE bytes of whole ones at a time
+static void chat_flush(struct chat *c, struct chat_peer *p){
+	while(p->sent < p->queued){
+		size_t n = p->queued - p->sent;
+		if(n > CHAT_MAX_MESSAGE){
+			const char *end = memrchr(p->queue + p->sent, '\n', CHAT_MAX_MESSAGE);
+			n = end - (p->queue + p->sent) + 1;
+		}
+		ssize_t r = write(p->fd, p->queue + p->sent, n);
+		if(r < 0 && errno == EAGAIN)
+			return; // still registered for EPOLLOUT
+		if(r < 0){
+			chat_close_peer(c, p);
+			return;
+		}
+		p->sent += r;
+	}
+	p->sent = p->queued = 0;
+	chat_watch(c, p->fd, 0, p, EPOLL_CTL_DEL);
+}
+
+static void chat_send(struct chat *c, struct chat_peer *p, const char *msg, size_t len){
+	if(p->fd < 0 && !chat_open_peer(c, p))
+		return; // its FIFO is there but nobody is reading it
+	if(p->sent == p->queued){
+		ssize_t r = write(p->fd, msg, len); // all or nothing, len <= PIPE_BUF
+		if(r == (ssize_t)len)
+			return;
+		if(r < 0 && errno != EAGAIN){
+			chat_close_peer(c, p);
+			return;
+		}
+		chat_watch(c, p->fd, EPOLLOUT, p, EPOLL_CTL_ADD);
+	}
+	if(p->queued + len > CHAT_QUEUE_LIMIT){
+		c->dropped++;
+		return;
+	}
+	if(p->queued + len > p->cap){
+		p->cap = p->cap ? p->cap * 2 : 4096;
+		while(p->cap < p->queued + len)
+			p->cap *= 2;
+		p->queue = realloc(p->queue, p->cap);
+	}
+	memcpy(p->queue + p->queued, msg, len);
+	p->queued += len;
+}
+
+//Format one typed line and hand it to every member
+static void chat_broadcast(struct chat *c, const char *line, size_t len){
+	char msg[CHAT_MAX_MESSAGE];
+	int head = snprintf(msg, sizeof(msg), "[%s] %s: ", c->room, c->user);
+	if(head < 0 || (size_t)head >= sizeof(msg) - 1)
+		return;
+	if(len > sizeof(msg) - head - 1)
+		len = sizeof(msg) - head - 1; // truncated rather than split across writes
+	memcpy(msg + head, line, len);
+	msg[head + len] = '\n';
+	for(int i = 0; i < c->count; i++)
+		chat_send(c, c->peers[i], msg, head + len + 1);
+}
+
+//Read stdin and send every complete line, returns false at end of input
+static bool chat_input(struct chat *c){
+	ssize_t r = read(c->stdin_fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+	if(r <= 0)
+		return false;
+	c->in_len += r;
+	char *start = c->in, *nl;
+	while((nl = memchr(start, '\n', c->in + c->in_len - start)) != NULL){
+		if(nl > start)
+			chat_broadcast(c, start, nl - start);
+		start = nl + 1;
+	}
+	c->in_len -= start - c->in;
+	memmove(c->in, start, c->in_len);
+	if(c->in_len == sizeof(c->in)){ // a line longer than a message
+		chat_broadcast(c, c->in, c->in_len);
+		c->in_len = 0;
+	}
+	return true;
+}
+
+//List the room: add new members, and forget those that are gone
+static void chat_scan(struct chat *c){
+	for(int i = 0; i < c->count; i++)
+		c->peers[i]->listed = false;
+	DIR *d = opendir(c->dir);
+	for(struct dirent *e; d != NULL && (e = readdir(d)) != NULL; )
+		if(e->d_name[0] != '.')
+			chat_add_peer(c, e->d_name);
+	if(d != NULL)
+		closedir(d);
+	for(int i = c->count - 1; i >= 0; i--)
+		if(!c->peers[i]->listed)
+			chat_remove_peer(c, c->peers[i]->name);
+}
+
+static void chat_membership(struct chat *c){
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while((n = read(c->inotify_fd, buf, sizeof(buf))) > 0){
+		for(char *p = buf; p < buf + n; ){
+			struct inotify_event *ev = (struct inotify_event *)p;
+			if(ev->len > 0){
+				if(ev->mask & (IN_CREATE | IN_MOVED_TO))
+					chat_add_peer(c, ev->name);
+				else if(ev->mask & (IN_DELETE | IN_MOVED_FROM))
+					chat_remove_peer(c, ev->name);
+			}
+			p += sizeof(struct inotify_event) + ev->len;
+		}
+	}
+}
+
+//CHATROOM --shm: the room is one shared memory segment holding a ring of
+//fixed slots. A sender claims the next sequence number with one atomic add,
+//so each slot has a single writer per lap, fills it and publishes it with a
+//seqlock stamp. Readers keep their own cursor, sleep on a futex word that
+//every publish bumps, and notice from the stamp when a slot was reused
+//before they got to it.
+#define CHAT_RING_MAGIC "SHXCHAT1"
+#define CHAT_RING_SLOTS 1024 // power of two
+#define CHAT_RING_SLOT_SIZE 4096
+#define CHAT_RING_WAIT_NS 100000000L // readers recheck their stop flag this often
+#define CHAT_RING_STALL_NS 1000000000L // a slot claimed but unpublished this long is skipped
+
+struct chat_slot {
+	uint64_t stamp; // 2*seq+1 while seq is being written, 2*seq+2 once published
+	uint32_t len;
+	int32_t sender; // pid, nobody reads back their own lines
+	char data[CHAT_RING_SLOT_SIZE - 16];
+};
+
+struct chat_ring {
+	char magic[8];
+	uint64_t head; // next sequence number to claim
+	uint32_t futex; // bumped by every publish, readers sleep on it
+	uint32_t sleepers; // readers in FUTEX_WAIT, so idle rooms cost no wake syscall
+	uint32_t members; // changed under flock on the segment, the last to leave unlinks it
+	char pad[36]; // slots start on a cache line
+	struct chat_slot slot[CHAT_RING_SLOTS];
+};
+
+struct chat_reader {
+	struct chat_ring *ring;
+	uint64_t cursor; // next sequence number to read
+	uint64_t lost; // overwritten before we read them
+	bool stop;
+};
+
+static long chat_futex(uint32_t *word, int op, uint32_t val, const struct timespec *timeout){
+	return syscall(SYS_futex, word, op, val, timeout, NULL, 0);
+}
+
+/**
+ * Map the room's ring, creating it on first use, and join it. A zeroed
+ * segment is an empty ring. Joining and leaving hold an exclusive flock on
+ * the segment, so nobody joins one the last member is unlinking. A member
+ * that is killed never leaves: its room stays in /dev/shm until removed.
+ * @param  room room name
+ * @param  fd   set to the segment's fd, for chat_ring_close
+ * @return      the ring, NULL with errno set on failure
+ */
+static struct chat_ring *chat_ring_open(const char *room, int *fd){
+	char name[NAME_MAX];
+	struct stat st;
+	snprintf(name, sizeof(name), "/shellax-chat-%s", room);
+	for(;;){
+		*fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if(*fd < 0)
+			return NULL;
+		flock(*fd, LOCK_EX);
+		if(fstat(*fd, &st) == -1){
+			int e = errno;
+			close(*fd);
+			errno = e;
+			return NULL;
+		}
+		if(st.st_nlink > 0)
+			break;
+		close(*fd); // the last member unlinked it while we waited, make a new one
+	}
+	int e = 0;
+	if(st.st_size == 0 && ftruncate(*fd, sizeof(struct chat_ring)) == -1)
+		e = errno;
+	else if(st.st_size != 0 && st.st_size != sizeof(struct chat_ring))
+		e = EPROTO; // made by an incompatible build
+	struct chat_ring *r = e ? MAP_FAILED : mmap(NULL, sizeof(struct chat_ring), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if(r == MAP_FAILED){
+		e = e ? e : errno;
+		close(*fd);
+		errno = e;
+		return NULL;
+	}
+	memcpy(r->magic, CHAT_RING_MAGIC, 8);
+	__atomic_fetch_add(&r->members, 1, __ATOMIC_SEQ_CST);
+	flock(*fd, LOCK_UN);
+	return r;
+}
+
+//Leave the room, unlinking its ring if nobody is left in it
+static void chat_ring_close(struct chat_ring *r, const char *room, int fd){
+	char name[NAME_MAX];
+	snprintf(name, sizeof(name), "/shellax-chat-%s", room);
+	flock(fd, LOCK_EX);
+	if(__atomic_sub_fetch(&r->members, 1, __ATOMIC_SEQ_CST) == 0)
+		shm_unlink(name);
+	close(fd); // drops the lock
+	munmap(r, sizeof(struct chat_ring));
+}
+
+/**
+ * Publish one message: an atomic add, a memcpy and, only if a reader
+ * sleeps, one futex wake
+ * @param r   ring
+ * @param msg message, truncated to a slot
+ * @param len its length
+ */
+static void chat_ring_publish(struct chat_ring *r, const char *msg, size_t len){
+	uint64_t seq = __atomic_fetch_add(&r->head, 1, __ATOMIC_RELAXED);
+	struct chat_slot *s = &r->slot[seq & (CHAT_RING_SLOTS - 1)];
+	//a writer a whole lap behind may still be in this slot, give it a moment
+	uint64_t previous = seq >= CHAT_RING_SLOTS ? 2 * (seq - CHAT_RING_SLOTS) + 2 : 0;
+	for(int i = 0; i < 1000 && __atomic_load_n(&s->stamp, __ATOMIC_ACQUIRE) < previous; i++)
+		sched_yield();
+	__atomic_store_n(&s->stamp, 2 * seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); // the odd stamp lands before any byte
+	if(len > sizeof(s->data))
+		len = sizeof(s->data);
+	memcpy(s->data, msg, len);
+	s->len = len;
+	s->sender = getpid();
+	__atomic_store_n(&s->stamp, 2 * seq + 2, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&r->futex, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&r->sleepers, __ATOMIC_SEQ_CST) > 0)
+		chat_futex(&r->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/**
+ * Copy out the message at the reader's cursor
+ * @param  rd     reader
+ * @param  out    at least a slot's data
+ * @param  sender set to the sender's pid
+ * @return        its length, 0 if it isn't published yet, -1 if the
+ *                reader was overrun and its cursor moved ahead
+ */
+static ssize_t chat_ring_read(struct chat_reader *rd, char *out, pid_t *sender){
+	struct chat_ring *r = rd->ring;
+	struct chat_slot *s = &r->slot[rd->cursor & (CHAT_RING_SLOTS - 1)];
+	uint64_t want = 2 * rd->cursor + 2;
+	uint64_t stamp = __atomic_load_n(&s->stamp, __ATOMIC_ACQUIRE);
+	if(stamp < want)
+		return 0;
+	if(stamp == want){
+		size_t len = s->len < sizeof(s->data) ? s->len : sizeof(s->data);
+		memcpy(out, s->data, len);
+		*sender = s->sender;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&s->stamp, __ATOMIC_RELAXED) == want){ // not reused while we copied
+			rd->cursor++;
+			return len;
+		}
+	}
+	//a later lap took the slot: skip to the oldest message that can still be there
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t oldest = head > CHAT_RING_SLOTS ? head - CHAT_RING_SLOTS + 1 : 0;
+	if(oldest <= rd->cursor)
+		oldest = rd->cursor + 1;
+	rd->lost += oldest - rd->cursor;
+	rd->cursor = oldest;
+	return -1;
+}
+
+//Print what others publish until stop is set
+static void *chat_ring_reader(void *arg){
+	struct chat_reader *rd = arg;
+	struct chat_ring *r = rd->ring;
+	static char msg[sizeof(((struct chat_slot *)0)->data)];
+	uint64_t reported = 0, stalled_at = UINT64_MAX;
+	struct timespec since = { 0, 0 }, now;
+	while(!__atomic_load_n(&rd->stop, __ATOMIC_ACQUIRE)){
+		pid_t sender;
+		uint32_t seen = __atomic_load_n(&r->futex, __ATOMIC_SEQ_CST);
+		ssize_t len = chat_ring_read(rd, msg, &sender);
+		if(len > 0 && sender != getpid())
+			write(STDOUT_FILENO, msg, len);
+		if(rd->lost > reported){
+			printf("-%s: chatroom: missed %llu messages\n", sysname, (unsigned long long)(rd->lost - reported));
+			fflush(stdout);
+			reported = rd->lost;
+		}
+		if(len != 0)
+			continue;
+		//a sender that died between claiming and publishing would block us forever
+		if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > rd->cursor){
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if(stalled_at != rd->cursor){
+				stalled_at = rd->cursor;
+				since = now;
+			} else if((now.tv_sec - since.tv_sec) * 1000000000L + now.tv_nsec - since.tv_nsec > CHAT_RING_STALL_NS){
+				rd->cursor++;
+				rd->lost++;
+				continue;
+			}
+		}
+		struct timespec timeout = { 0, CHAT_RING_WAIT_NS };
+		__atomic_fetch_add(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&r->slot[rd->cursor & (CHAT_RING_SLOTS - 1)].stamp, __ATOMIC_SEQ_CST) < 2 * rd->cursor + 2)
+			chat_futex(&r->futex, FUTEX_WAIT, seen, &timeout);
+		__atomic_fetch_sub(&r->sleepers, 1, __ATOMIC_SEQ_CST);
+	}
+	return NULL;
+}
+
+//chatroom --shm: stdin lines go into the ring, a thread prints the others'
+static int chatroom_shm(const char *room, const char *user){
+	int fd;
+	struct chat_ring *r = chat_ring_open(room, &fd);
+	if(r == NULL){
+		printf("-%s: chatroom: %s\n", sysname, strerror(errno));
+		return UNKNOWN;
+	}
+	struct chat_reader rd = { .ring = r, .cursor = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) };
+	pthread_t reader;
+	printf("Welcome to %s %s\n", room, user);
+	fflush(stdout);
+	int e = pthread_create(&reader, NULL, chat_ring_reader, &rd);
+	if(e != 0){
+		printf("-%s: chatroom: %s\n", sysname, strerror(e));
+		chat_ring_close(r, room, fd);
+		return UNKNOWN;
+	}
+
+	struct line_reader lr;
+	const char *line;
+	ssize_t len;
+	char msg[sizeof(r->slot[0].data)];
+	lr_init(&lr, STDIN_FILENO);
+	while((len = lr_next(&lr, &line)) >= 0){
+		if(len == 0)
+			continue;
+		int n = snprintf(msg, sizeof(msg), "[%s] %s: %.*s\n", room, user, (int)len, line);
+		if(n >= (int)sizeof(msg)){ // truncated, keep the newline
+			n = sizeof(msg);
+			msg[n - 1] = '\n';
+		}
+		chat_ring_publish(r, msg, n);
+	}
+	lr_free(&lr);
+
+	__atomic_store_n(&rd.stop, true, __ATOMIC_RELEASE);
+	pthread_join(reader, NULL);
+	chat_ring_close(r, room, fd);
+	return SUCCESS;
+}
+
+/**
+ * chatroom [--shm] <room> <user>: join the room and relay lines between
+ * stdin, our FIFO and the other members' FIFOs until end of input, or
+ * with --shm through the room's shared memory ring
+ * @param  command [description]
+ * @return         SUCCESS, UNKNOWN on bad arguments or setup errors
+ */
+int chatroom(struct command_t *command){
+	bool shm = command->arg_count > 0 && strcmp(command->args[0], "--shm") == 0;
+	char **args = command->args + shm;
+	if(command->arg_count - shm != 2 || strchr(args[0], '/') || strchr(args[1], '/') || args[1][0] == '.'){
+		printf("-%s: chatroom: usage: chatroom [--shm] <room> <user>\n", sysname);
+		return UNKNOWN;
+	}
+	signal(SIGPIPE, SIG_IGN); // a member that left is EPIPE on its FIFO, not the end of us
+	if(shm)
+		return chatroom_shm(args[0], args[1]);
+	struct chat c = { .room = args[0], .user = args[1], .stdin_fd = STDIN_FILENO };
+	char path[PATH_MAX];
+	snprintf(c.dir, sizeof(c.dir), "/tmp/chatroom-%s", c.room);
+	snprintf(path, sizeof(path), "%s/%s", c.dir, c.user);
+	if((mkdir(c.dir, 0700) == -1 && errno != EEXIST) || (mkfifo(path, 0666) == -1 && errno != EEXIST)){
+		printf("-%s: chatroom: %s\n", sysname, strerror(errno));
+		return UNKNOWN;
+	}
+	//read-write, so the FIFO never reports end of file between writers
+	c.fifo_fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	c.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(c.fifo_fd < 0 || c.epoll_fd < 0){
+		printf("-%s: chatroom: %s\n", sysname, strerror(errno));
+		return UNKNOWN;
+	}
+	//inotify instances are limited per user (128 by default), past that we rescan
+	c.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(c.inotify_fd >= 0 && inotify_add_watch(c.inotify_fd, c.dir,
+				IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0){
+		close(c.inotify_fd);
+		c.inotify_fd = -1;
+	}
+	//watch first, then list, so nobody joins unseen in between
+	chat_scan(&c);
+	struct timespec scanned, now;
+	clock_gettime(CLOCK_MONOTONIC, &scanned);
+	c.stdin_polled = chat_watch(&c, c.stdin_fd, EPOLLIN, &c.stdin_fd, EPOLL_CTL_ADD);
+	chat_watch(&c, c.fifo_fd, EPOLLIN, &c.fifo_fd, EPOLL_CTL_ADD);
+	if(c.inotify_fd >= 0)
+		chat_watch(&c, c.inotify_fd, EPOLLIN, &c.inotify_fd, EPOLL_CTL_ADD);
+
+	printf("Welcome to %s %s\n", c.room, c.user);
+	fflush(stdout);
+	static char relay[1 << 16];
+	bool open = true;
+	while(open){
+		struct epoll_event events[CHAT_EVENTS];
+		int timeout = !c.stdin_polled ? 0 : c.inotify_fd >= 0 ? -1 : CHAT_RESCAN_MS;
+		int n = epoll_wait(c.epoll_fd, events, CHAT_EVENTS, timeout);
+		if(n < 0 && errno != EINTR)
+			break;
+		bool membership = false;
+		for(int i = 0; i < n && open; i++){
+			void *tag = events[i].data.ptr;
+			if(tag == &c.fifo_fd){
+				ssize_t r;
+				while((r = read(c.fifo_fd, relay, sizeof(relay))) > 0)
+					write(STDOUT_FILENO, relay, r);
+			} else if(tag == &c.inotify_fd){
+				membership = true; // after this batch, its events may name peers it frees
+			} else if(tag == &c.stdin_fd){
+				open = chat_input(&c);
+			} else {
+				struct chat_peer *p = tag;
+				if(events[i].events & (EPOLLERR | EPOLLHUP))
+					chat_close_peer(&c, p);
+				else
+					chat_flush(&c, p);
+			}
+		}
+		if(open && !c.stdin_polled)
+			open = chat_input(&c);
+		if(membership)
+			chat_membership(&c);
+		if(c.inotify_fd < 0){
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if((now.tv_sec - scanned.tv_sec) * 1000 + (now.tv_nsec - scanned.tv_nsec) / 1000000 >= CHAT_RESCAN_MS){
+				chat_scan(&c);
+				scanned = now;
+			}
+		}
+	}
+
+	unlink(path); // writers get EPIPE and forget us
+	for(int i = c.count - 1; i >= 0; i--)
+		chat_remove_peer(&c, c.peers[i]->name);
+	free(c.peers);
+	close(c.fifo_fd);
+	if(c.inotify_fd >= 0)
+		close(c.inotify_fd);
+	close(c.epoll_fd);
+	if(c.dropped > 0)
+		printf("-%s: chatroom: %lu messages dropped for slow readers\n", sysname, c.dropped);
+	return SUCCESS;
+}
+
+int process_command(struct command_t *command)
+{
+	if (strcmp(command->name, "")==0) return SUCCESS;
+	if (strcmp(command->name, "time")==0) return time_command(command);
+
+	//A lone builtin that can run in the shell does, no fork at all
+	const struct builtin *b=builtin_find(command);
+	if (builtin_in_shell(b, command))
+	{
+		fflush(stdout);
+		struct redirection rd;
+		int saved[3];
+		if (command->redirect_count>0)
+		{
+			TRACE_BEGIN(trace_start);
+			int redirected=io_redirect(command, -1, -1, &rd);
+			TRACE_END(trace_start, "redirect", command->name);
+			if (redirected!=SUCCESS)
+			{
+				last_status=1;
+				return SUCCESS;
+			}
+			redirect_save(&rd, saved);
+		}
+		TRACE_BEGIN(trace_start);
+		last_status=b->run(command, STDIN_FILENO, STDOUT_FILENO);
+		TRACE_END(trace_start, "builtin", command->name);
+		fflush(stdout);
+		if (command->redirect_count>0)
+		{
+			redirect_restore(saved);
+			redirect_close(&rd);
+		}
+		return shell_exiting ? EXIT : SUCCESS;
+	}
+	TRACE_BEGIN(trace_start);
+	int code = run_pipeline(command);
+	TRACE_END(trace_start, "pipeline", command->name);
+	return code;
+}